@@ -37,7 +37,12 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <linux/errqueue.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <netdb.h>
@@ -47,43 +52,198 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <err.h>
 #include <pthread.h>
+#include <zlib.h>
+#ifdef	USEURING
+#include <liburing.h>
+#endif
 #include <websocket.h>
 
 #ifndef	MAXTCP
 #define MAXTCP 32768            // we use a lot of sockets but usually short messages, so reduce footprint
 #endif
 
+#ifndef	RXBUF
+#define	RXBUF 16384             // Read buffer
+#endif
+
+#ifndef	RXMIN
+#define	RXMIN 1024              // Initial message buffer, doubled as needed
+#endif
+
+#ifndef	POOLMAG
+#define	POOLMAG 32              // Objects moved between a thread's pool cache and the shared depot at a time
+#endif
+
+#ifndef	TOPICS
+#define	TOPICS 256              // Pub/sub topic hash buckets
+#endif
+
+#ifndef	CONFLATE
+#define	CONFLATE 64             // Conflation key hash buckets per connection
+#endif
+
+#ifndef	DEFLATEMIN
+#define	DEFLATEMIN 64           // Default smallest payload compressed
+#endif
+
+#ifndef	HEADERS
+#define	HEADERS 64              // Most request headers
+#endif
+
+#ifndef	BODYMAX
+#define	BODYMAX (16*1024*1024)  // Largest HTTP request body
+#endif
+
+#ifndef	RNGBLOCKS
+#define	RNGBLOCKS 16            // ChaCha20 blocks made at a time for session ids
+#endif
+
+#ifndef	TXIOV
+#define	TXIOV 64                // Max iovec in one gathered write
+#endif
+
+#ifdef	USEURING
+#ifndef	URENTRIES
+#define	URENTRIES 1024          // io_uring submission queue size
+#endif
+#ifndef	URBUFS
+#define	URBUFS 128              // io_uring provided receive buffers (each RXBUF), power of 2
+#endif
+#endif
+
 const char wscookie[] = "wssession";
 
 int websocket_debug = 0;
 
 typedef struct websocket_bind_s websocket_bind_t;
 typedef struct websocket_path_s websocket_path_t;
+typedef struct websocket_router_s websocket_router_t;
+typedef websocket_router_t *websocket_router_p;
+typedef struct websocket_reactor_s websocket_reactor_t;
+typedef struct websocket_listener_s websocket_listener_t;
+typedef struct websocket_job_s websocket_job_t;
 typedef websocket_t *websocket_p;
 
+typedef struct websocket_conflate_s websocket_conflate_t;
+
+typedef struct txs_s txs_t;
+struct txs_s
+{                               // A streamed message, the app makes a fragment at a time as it is sent
+   websocket_stream_t *cb;
+   void *arg;
+   size_t fragment;             // Max fragment size
+   unsigned char opcode;        // Opcode for the first fragment, 0 (continuation) once started
+};
+
 typedef struct txb_s txb_t;
+typedef txb_t *txb_p;
 struct txb_s
-{
-   volatile int count;          // how many instances in txqs
-   pthread_mutex_t mutex;       // protect count
-   unsigned char head[14];
+{                               // Shared by every txq it is on, count, header and len in one cache line
+   atomic_int count;            // how many instances in txqs (plus one for creator)
    unsigned char hlen;
-   unsigned char *buf;
+   unsigned char head[14];
+   unsigned char zbits;         // Window bits used, if this is a compressed copy
    size_t len;
+   unsigned char *buf;
+   websocket_conflate_t *conflate;      // If set, this is a place holder for the latest message for a key
+   txs_t *stream;               // If set, head and buf are the current fragment (hlen 0 if not made yet)
+   websocket_release_t *release;        // If set, buf is owned by the app, call this rather than free
+   void *arg;
+   _Atomic (txb_p) deflated;    // Compressed copy, made once for connections without context takeover (may be this block if no smaller)
+};
+
+typedef struct txz_s txz_t;
+struct txz_s
+{                               // Blocks referenced by a MSG_ZEROCOPY send until the kernel is done with them
+   txz_t *next;
+   uint32_t seq;                // Zero copy send number
+   int n;
+   txb_t *b[];
+};
+
+struct websocket_conflate_s
+{                               // Latest message for a conflation key on a connection (protected by cmutex)
+   websocket_conflate_t *next;  // Bucket chain
+   unsigned int hash;
+   txb_t *txb;                  // Message waiting, its place holder is in the queue, NULL if none
+   char key[];
 };
 
 typedef struct txq_s txq_t;
 typedef txq_t *txq_p;
 struct txq_s
-{                               // Queue of transmit data
-   volatile txq_p next;
+{                               // Queue of transmit data (lock free, many producers, one consumer)
+   _Atomic (txq_p) next;
    txb_t *data;
 };
 
+typedef struct websocket_topic_s websocket_topic_t;
+struct websocket_topic_s
+{                               // A pub/sub topic (protected by its bucket lock)
+   websocket_topic_t *next;     // Bucket chain
+   unsigned int hash;
+   int nsubs;                   // Subscribers
+   int maxsubs;                 // Space allocated in subs
+   websocket_t **subs;          // Subscribers (malloc)
+   char name[];
+};
+
+typedef struct websocket_sub_s websocket_sub_t;
+struct websocket_sub_s
+{                               // A topic a connection is subscribed to
+   websocket_sub_t *next;
+   websocket_topic_t *topic;
+};
+
+struct websocket_job_s
+{                               // Received message waiting for a callback worker
+   websocket_job_t *next;
+   unsigned char *data;         // Raw data (malloc, or from rxalloc, passed to raw callback)
+   size_t len;
+#ifdef	USEAXL
+   xml_t xml;                   // Parsed data
+#endif
+#ifdef	USEAJL
+   j_t json;                    // Parsed data
+#endif
+};
+
+#ifdef	USEAJL
+typedef struct websocket_rxjson_s websocket_rxjson_t;
+struct websocket_rxjson_s
+{                               // Incremental JSON parse of a message as it is received
+   j_t json;                    // Message being built, NULL between messages
+   struct
+   {
+      j_t j;
+      unsigned char obj;        // Object, else array
+   } *stack;                    // Open objects and arrays (malloc)
+   int depth,
+     stackmax;
+   unsigned char state;         // RXJ_...
+   unsigned char key:1;         // String is a name
+   unsigned char hex;           // Hex digits still to come in \u escape
+   unsigned int u;              // \u escape
+   unsigned int hi;             // High surrogate waiting for low surrogate
+   char *tok,                   // String or literal so far, or whole top level value if not object or array (malloc)
+    *name;                      // Name for the next value in an object (malloc)
+   size_t toklen,
+     tokmax,
+     namemax;
+};
+#endif
+
 struct websocket_bind_s
 {                               // The bound ports / threads
    websocket_bind_t *next;
@@ -91,12 +251,26 @@ struct websocket_bind_s
    const char *certfile;
    const char *keyfile;         // NULL if not ssl
    SSL_CTX *ctx;                // SSL context
-   int socket;                  // listening socket
+   int listeners;               // Number of listening sockets
+   int workers;                 // Using callback worker threads
+   size_t txbudget;             // Max bytes of queued messages in one write
+   size_t zerocopy;             // Min payload to send with MSG_ZEROCOPY (0 for never)
+   websocket_listener_t *listener;      // Listening sockets
    websocket_path_t *paths;
-   pthread_mutex_t mutex;       // Protect sessions
+   _Atomic unsigned int pathgen;        // Changed when paths added
+   _Atomic (websocket_router_p) router; // Made from paths
+   _Atomic (websocket_router_p) retired;        // Previous routers, freed when no request is routing (protected by mutex)
+   _Atomic unsigned int routing;        // Requests using a router
+   pthread_mutex_t mutex;       // Protect sessions and paths
    volatile websocket_p sessions;
 };
 
+struct websocket_listener_s
+{                               // A listening socket (several if using SO_REUSEPORT)
+   websocket_bind_t *bind;
+   int socket;
+};
+
 struct websocket_path_s
 {                               // The bound paths on a port
    websocket_path_t *next;
@@ -110,6 +284,51 @@ struct websocket_path_s
 #ifdef	USEAJL
    websocket_callback_json_t *callbackjson;
    websocket_callback_jsonraw_t *callbackjsonraw;
+#endif
+   websocket_callback_full_t *callbackfull;
+   size_t txmaxbytes;           // Queue limits for connections (0 for none)
+   int txmaxmsgs;
+   int txpolicy;                // WEBSOCKET_FULL_...
+   websocket_rxalloc_t *callbackrxalloc;        // Buffers for raw data (NULL to use malloc)
+   websocket_rxstream_t *callbackrxstream;      // Data passed on as it arrives (NULL to collect whole messages)
+   size_t rxmax;                // Largest message accepted (0 for no limit)
+   int rxidle;                  // Seconds idle before freeing message buffer (0 for never)
+   int deflate;                 // permessage-deflate compression level (0 for not offered)
+   unsigned char deflatebits;   // Window bits
+   unsigned char deflatemem;    // zlib memory level
+   unsigned char deflatetakeover;       // Keep compression context between messages
+   size_t deflatemin;           // Smallest payload compressed
+};
+
+typedef struct websocket_pmd_s websocket_pmd_t;
+struct websocket_pmd_s
+{                               // permessage-deflate agreed for a connection
+   unsigned char txbits;        // Window bits we compress with
+   unsigned char rxbits;        // Window bits the far end compresses with
+   unsigned char takeover:1;    // We keep compression context between messages
+   unsigned char txinit:1;      // tx set up (tx only)
+   unsigned char rxinit:1;      // rx set up (rx only)
+   z_stream tx;
+   z_stream rx;
+   unsigned char *out;          // Inflate buffer for messages passed on in parts (RXBUF, malloc)
+};
+
+struct websocket_reactor_s
+{                               // Event engine thread, handles many sockets
+   pthread_t thread;
+   int epoll;                   // epoll fd
+   int event;                   // eventfd used to kick tx
+   pthread_mutex_t mutex;       // Protect kick list
+   websocket_p kick;            // Sockets with tx to do
+   websocket_p sessions;        // Sockets handled by this reactor (reactor thread only)
+   websocket_p dead;            // Sockets to free at end of this pass (reactor thread only)
+#ifdef	USEURING
+   unsigned char uring:1;       // Using io_uring
+   struct io_uring ring;
+   struct io_uring_buf_ring *br;        // Provided receive buffers
+   unsigned char *bufs;
+   websocket_listener_t **arm;  // Listening sockets waiting for multishot accept to be set up (protected by mutex)
+   int narm;
 #endif
 };
 
@@ -118,20 +337,97 @@ struct websocket_s
    volatile websocket_p next;
    websocket_bind_t *bind;
    websocket_path_t *path;
-   char *from;
+   char from[INET6_ADDRSTRLEN];
    SSL *ss;                     // SSL connection if applicable, else NULL
-   unsigned char *rxdata;       // Received data so far (malloc)
+   unsigned char *rxdata;       // Received data so far (malloc), kept for the next message once connected
    size_t rxptr;                // Pointer in to buffer
    size_t rxlen;                // Length of buffer allocated
+   size_t rxep;                 // End of request headers, 0 if not yet seen
+   size_t rxwant;               // Request length including any body (SIZE_MAX means until closed)
    void *data;                  // App data link
    long ping;                   // Ping time (us)
    pthread_mutex_t mutex;       // Protect volatile
-   volatile txq_p txq,
-     txe;
+   txq_p txq;                   // Last sent (or txstub), queue starts at its next (tx only)
+   _Atomic (txq_p) txe;         // Last queued
+   atomic_int txn;              // Number queued, tx is woken when this goes from 0
+   txq_t txstub;                // Initial txq
+   txb_t *txhs;                 // Switching protocols response, sent before txq
+   _Atomic (txq_p) ctlq;        // Control frames to send (any thread, pushed so newest first)
+   txq_p txctl;                 // Control frames being sent, in order, before txq (tx only)
+   unsigned char zc:1;          // Using MSG_ZEROCOPY
+   uint32_t zcseq;              // Next zero copy send number (tx only)
+   txz_t *zcq,                  // Zero copy sends waiting for the kernel to finish with them (tx only)
+    *zce;
+   atomic_size_t txbytes;       // Bytes queued
+   size_t txmaxbytes;           // Queue limits (0 for none)
+   int txmaxmsgs;
+   unsigned char txpolicy;      // WEBSOCKET_FULL_...
+   unsigned char txnotified;    // Told app queue is full (tx only)
+   atomic_uchar txover;         // A message was not queued as full, 2 once closing
+   pthread_mutex_t cmutex;      // Protect conflate
+   websocket_conflate_t **conflate;     // Conflation keys, CONFLATE buckets (malloc)
    volatile int socket;         // rx socket
    volatile int pipe[2];        // pipe used to kick tx
    volatile unsigned char connected:1;
    volatile unsigned char closed:1;
+   unsigned char rxeof:1;       // Connection closed by far end during request
+   unsigned char rxcont:1;      // Request wants a 100 Continue before its body
+   // Event engine
+   websocket_reactor_t *reactor;        // Reactor handling this socket, NULL if using threads
+   websocket_p rnext,           // Reactor sessions (or dead list)
+     rprev;
+   websocket_p knext;           // Reactor kick list
+   unsigned char kicked;        // On kick list (protected by reactor mutex)
+   unsigned char dead;          // Closed and waiting to be freed (protected by reactor mutex)
+   unsigned char sslok:1;       // SSL accept done
+   unsigned char uring:1;       // Using io_uring for this socket
+#ifdef	USEURING
+   unsigned char txfail:1;      // A send failed (io_uring)
+   unsigned char recving:1;     // Multishot receive active (io_uring)
+   unsigned short inflight;     // io_uring operations that reference this socket
+   unsigned short txsends;      // io_uring sends in progress
+   struct msghdr *txmsg;        // io_uring send (malloc, TXIOV iovec follow)
+#endif
+   uint32_t events;             // epoll events registered
+   unsigned char *rxbuf;        // Read buffer (RXBUF)
+   size_t rxget,                // Unprocessed data in rxbuf
+     rxput;
+   size_t rxleft;               // Payload left to receive for current frame
+   unsigned char rxhead[14];    // Frame header being received
+   unsigned char rxhptr,
+     rxhlen;
+   unsigned char rxmask;        // Mask phase in payload
+   unsigned char rxop;          // Opcode of message being received (0 if none)
+   unsigned char rxctl[125];    // Control frame payload
+   unsigned char rxctlen;
+   unsigned char rxu8[4];       // UTF-8 sequence split between parts of a text message
+   unsigned char rxu8n;
+   unsigned char rxstarted:1;   // Stream callback has had the start of this message
+#ifdef	USEAJL
+   websocket_rxjson_t *rxjson;  // JSON callback message parse (malloc)
+#endif
+   unsigned char rxover:1;      // Sent close as message refused, ignoring the rest
+   unsigned char rxapp:1;       // rxdata is from the path rxalloc
+   unsigned char rxz:1;         // Message being received is compressed
+   websocket_pmd_t *pmd;        // permessage-deflate, NULL if not agreed (malloc)
+   time_t rxused;               // Last message received (for rxidle)
+   size_t txptr;                // Bytes of current txq (head then buf) sent
+   unsigned char *txssl;        // TLS write that would block, retried exactly as it was (malloc)
+   size_t txssllen;
+   unsigned char throttled;     // Not reading as too many callbacks waiting (reactor thread only)
+   // Callback workers (protected by workmutex)
+   websocket_job_t *jobq,       // Messages waiting for callback
+    *jobe;
+   int jobs;                    // Number of messages waiting
+   websocket_p wnext;           // Worker run queue
+   unsigned char wsched;        // On worker run queue or running
+   unsigned char wfail;         // A callback failed, discard the rest
+   unsigned char wclose;        // Closed, tell app and free once jobs are done
+   txb_t *txres;                // HTTP response to send when not connected
+   unsigned char txcont;        // txres is a 100 Continue, carry on reading the request once sent
+   pthread_mutex_t submutex;    // Protect subs (taken before topic bucket locks)
+   websocket_sub_t *subs;       // Topics subscribed
+   time_t when;                 // Handshake timeout, or next ping when connected
 };
 
 void
@@ -166,57 +462,258 @@ websocket_set_data (websocket_t * w, void *data)
 }
 
 static websocket_bind_t *binds = NULL;
+static websocket_reactor_t *reactors = NULL;    // Event engine threads, if used
+static int nreactors = 0;
+static pthread_mutex_t workmutex = PTHREAD_MUTEX_INITIALIZER;   // Callback workers, if used
+static pthread_cond_t workcond = PTHREAD_COND_INITIALIZER;      // Something on run queue
+static pthread_cond_t workspace = PTHREAD_COND_INITIALIZER;     // A connection is no longer full
+static websocket_p workq = NULL,
+   worke = NULL;
+static int workers = 0;
+static int workmax = 0;         // Max jobs waiting per connection
+static struct
+{                               // Pub/sub topics
+   pthread_rwlock_t lock;       // Read to publish, write to subscribe or unsubscribe
+   websocket_topic_t *topics;
+} topics[TOPICS] = {[0 ... TOPICS - 1] = {PTHREAD_RWLOCK_INITIALIZER} };
+
+typedef struct pool_s pool_t;
+struct pool_s
+{                               // Fixed size object pool, per thread cache and a shared depot of magazines
+   int id;                      // Thread cache index
+   size_t size;                 // Object size (at least two pointers)
+   pthread_mutex_t mutex;       // Protect depot
+   void *depot;                 // Magazines of POOLMAG objects linked by first word, next magazine in second word
+   size_t slabs;                // Slabs of POOLMAG objects allocated
+#ifdef	POOLSTATS
+   atomic_long live;            // Objects in use
+   atomic_long high;            // High water mark
+#endif
+};
+enum
+{ POOL_TXB, POOL_TXQ, POOL_WS, POOLS };
+static pool_t pools[POOLS] = {
+   {.id = POOL_TXB,.size = sizeof (txb_t),.mutex = PTHREAD_MUTEX_INITIALIZER},
+   {.id = POOL_TXQ,.size = sizeof (txq_t),.mutex = PTHREAD_MUTEX_INITIALIZER},
+   {.id = POOL_WS,.size = sizeof (websocket_t),.mutex = PTHREAD_MUTEX_INITIALIZER},
+};
+
+typedef struct poolcache_s poolcache_t;
+struct poolcache_s
+{                               // Per thread free objects for a pool
+   void *free;
+   int n;
+};
+static __thread poolcache_t poolcache[POOLS];
+static __thread unsigned char poolthread;       // Set up to flush cache on thread exit
+static pthread_key_t poolkey;
+static pthread_once_t poolonce = PTHREAD_ONCE_INIT;
+
+static void
+pool_depot (pool_t * p, void *m)
+{                               // Give a magazine to the depot
+   pthread_mutex_lock (&p->mutex);
+   ((void **) m)[1] = p->depot;
+   p->depot = m;
+   pthread_mutex_unlock (&p->mutex);
+}
+
+static void
+pool_exit (void *v)
+{                               // Thread exit, give its cached objects to the depot
+   poolcache_t *c = v;
+   int i;
+   for (i = 0; i < POOLS; i++)
+      if (c[i].free)
+      {
+         pool_depot (&pools[i], c[i].free);
+         c[i].free = NULL;
+         c[i].n = 0;
+      }
+}
+
+static void
+pool_key (void)
+{
+   pthread_key_create (&poolkey, pool_exit);
+}
+
+static poolcache_t *
+pool_cache (pool_t * p)
+{                               // This thread's cache for a pool
+   if (!poolthread)
+   {
+      poolthread = 1;
+      pthread_once (&poolonce, pool_key);
+      pthread_setspecific (poolkey, poolcache);
+   }
+   return &poolcache[p->id];
+}
+
+static void *
+pool_alloc (pool_t * p)
+{                               // Allocate a zeroed object, NULL if malloc fails
+   poolcache_t *c = pool_cache (p);
+   if (!c->free)
+   {                            // Refill from depot, or a new slab
+      pthread_mutex_lock (&p->mutex);
+      void *m = p->depot;
+      if (m)
+         p->depot = ((void **) m)[1];
+      pthread_mutex_unlock (&p->mutex);
+      if (!m)
+      {
+         unsigned char *slab = malloc (p->size * POOLMAG);
+         if (!slab)
+            return NULL;
+         pthread_mutex_lock (&p->mutex);
+         p->slabs++;
+         pthread_mutex_unlock (&p->mutex);
+         int i;
+         for (i = 0; i < POOLMAG; i++)
+            *(void **) (slab + i * p->size) = (i + 1 < POOLMAG ? slab + (i + 1) * p->size : NULL);
+         m = slab;
+      }
+      c->free = m;
+      c->n = POOLMAG;
+   }
+   void *o = c->free;
+   c->free = *(void **) o;
+   if (c->n)
+      c->n--;
+   memset (o, 0, p->size);
+#ifdef	POOLSTATS
+   long live = atomic_fetch_add_explicit (&p->live, 1, memory_order_relaxed) + 1,
+      high = atomic_load_explicit (&p->high, memory_order_relaxed);
+   while (live > high && !atomic_compare_exchange_weak_explicit (&p->high, &high, live, memory_order_relaxed, memory_order_relaxed));
+#endif
+   return o;
+}
+
+static void
+pool_free (pool_t * p, void *o)
+{                               // Free an object to this thread's cache, giving a magazine to the depot if too many
+   if (!o)
+      return;
+   poolcache_t *c = pool_cache (p);
+   if (c->n >= 2 * POOLMAG)
+   {
+      void *m = c->free,
+         **e = m;
+      int i;
+      for (i = 1; i < POOLMAG && *e; i++)
+         e = *e;
+      c->free = *e;
+      c->n -= i;
+      *e = NULL;
+      pool_depot (p, m);
+   }
+   *(void **) o = c->free;
+   c->free = o;
+   c->n++;
+#ifdef	POOLSTATS
+   atomic_fetch_sub_explicit (&p->live, 1, memory_order_relaxed);
+#endif
+}
+
+void
+websocket_pool_stats (websocket_poolstat_t * txb, websocket_poolstat_t * txq, websocket_poolstat_t * ws)
+{                               // Get pool statistics
+   websocket_poolstat_t *stat[POOLS] = { txb, txq, ws };
+   int i;
+   for (i = 0; i < POOLS; i++)
+      if (stat[i])
+      {
+         pool_t *p = &pools[i];
+         memset (stat[i], 0, sizeof (*stat[i]));
+         pthread_mutex_lock (&p->mutex);
+         stat[i]->slabs = p->slabs;
+         pthread_mutex_unlock (&p->mutex);
+#ifdef	POOLSTATS
+         stat[i]->live = atomic_load (&p->live);
+         stat[i]->high = atomic_load (&p->high);
+#endif
+      }
+}
+
 static void
 txb_done (txb_t * b)
 {                               // Count down and maybe even free
-   pthread_mutex_lock (&b->mutex);
-   int c = --b->count;
-   pthread_mutex_unlock (&b->mutex);
-   if (!c)
+   if (atomic_fetch_sub_explicit (&b->count, 1, memory_order_release) == 1)
    {                            // free
-      free (b->buf);
-      free (b);
+      atomic_thread_fence (memory_order_acquire);       // All other users done with it
+      if (b->stream)
+      {                         // Tell app finished with
+         b->stream->cb (b->stream->arg, NULL, 0);
+         free (b->stream);
+      }
+      if (b->release)
+         b->release (b->arg, b->buf);
+      else
+         free (b->buf);
+      txb_t *d = atomic_load_explicit (&b->deflated, memory_order_relaxed);
+      if (d && d != b)
+         txb_done (d);
+      pool_free (&pools[POOL_TXB], b);
    }
 }
 
+static void
+txb_head (txb_t * txb, unsigned char op)
+{                               // Set header for len
+   size_t len = txb->len;
+   int p = 0;
+   txb->head[p++] = op;
+   if (len > 65535)
+   {
+      txb->head[p++] = 127;
+      txb->head[p++] = ((unsigned long long) len >> 56);
+      txb->head[p++] = ((unsigned long long) len >> 48);
+      txb->head[p++] = ((unsigned long long) len >> 40);
+      txb->head[p++] = ((unsigned long long) len >> 32);
+      txb->head[p++] = (len >> 24);
+      txb->head[p++] = (len >> 16);
+      txb->head[p++] = (len >> 8);
+      txb->head[p++] = (len);
+   } else if (len >= 126)
+   {
+      txb->head[p++] = 126;
+      txb->head[p++] = (len >> 8);
+      txb->head[p++] = (len);
+   } else
+      txb->head[p++] = len;
+   txb->hlen = p;
+}
+
 static txb_t *
 txb_new_data (size_t len, const unsigned char *buf)
-{                               // Make a block from XML (count set to 1) - assuming buf malloc'd
-   txb_t *txb = malloc (sizeof (*txb));
-   memset (txb, 0, sizeof (*txb));
-   pthread_mutex_init (&txb->mutex, NULL);
+{                               // Make a block from XML (count set to 1) - assuming buf malloc'd, NULL if cannot (buf not freed)
+   txb_t *txb = pool_alloc (&pools[POOL_TXB]);
+   if (!txb)
+      return NULL;
    txb->len = len;
    txb->buf = (unsigned char *) buf;
-   txb->count = 1;              // Initial count to one so not zapped whilst adding to queues
-   int p = 0;
+   atomic_init (&txb->count, 1);        // Initial count to one so not zapped whilst adding to queues
    if (!buf)
    {                            // close
       txb->head[0] = 0x88;      // close
       txb->head[1] = 0;         // zero len
       txb->hlen = 2;
    } else
-   {
-      txb->head[p++] = 0x81;    // Text, one block
-      if (len > 65535)
-      {
-         txb->head[p++] = 127;
-         txb->head[p++] = ((unsigned long long) len >> 56);
-         txb->head[p++] = ((unsigned long long) len >> 48);
-         txb->head[p++] = ((unsigned long long) len >> 40);
-         txb->head[p++] = ((unsigned long long) len >> 32);
-         txb->head[p++] = (len >> 24);
-         txb->head[p++] = (len >> 16);
-         txb->head[p++] = (len >> 8);
-         txb->head[p++] = (len);
-      } else if (len >= 126)
-      {
-         txb->head[p++] = 126;
-         txb->head[p++] = (len >> 8);
-         txb->head[p++] = (len);
-      } else
-         txb->head[p++] = len;
-      txb->hlen = p;
-   }
+      txb_head (txb, 0x81);     // Text, one block
+   return txb;
+}
+
+static txb_t *
+txb_new_close (unsigned short code)
+{                               // Make a close block with a status code (count set to 1), NULL if cannot
+   txb_t *txb = txb_new_data (0, NULL);
+   if (!txb)
+      return NULL;
+   txb->head[1] = 2;
+   txb->head[2] = (code >> 8);
+   txb->head[3] = code;
+   txb->hlen = 4;
    return txb;
 }
 
@@ -232,7 +729,10 @@ txb_new_xml (xml_t d)
    if (d)
       xml_write_json (out, d);
    fclose (out);
-   return txb_new_data (len, (unsigned char *) buf);
+   txb_t *txb = txb_new_data (len, (unsigned char *) buf);
+   if (!txb)
+      free (buf);
+   return txb;
 }
 #endif
 #ifdef	USEAJL
@@ -244,26 +744,31 @@ txb_new_json (j_t d)
    char *buf = NULL;
    size_t len = 0;
    j_err (j_write_mem (d, &buf, &len));
-   return txb_new_data (len, (unsigned char *) buf);
+   txb_t *txb = txb_new_data (len, (unsigned char *) buf);
+   if (!txb)
+      free (buf);
+   return txb;
 }
 #endif
 
 static void
-txb_queue (websocket_t * w, txb_t * txb)
-{                               // Add a block to a websocket (NULL means close)
-   txq_t *txq = malloc (sizeof (*txq));
-   memset (txq, 0, sizeof (*txq));
-   txq->data = txb;
-   pthread_mutex_lock (&txb->mutex);
-   txb->count++;
-   pthread_mutex_unlock (&txb->mutex);
-   pthread_mutex_lock (&w->mutex);
-   if (w->txq)
-      w->txe->next = txq;
-   else
-      w->txq = txq;
-   w->txe = txq;
-   pthread_mutex_unlock (&w->mutex);
+websocket_kick (websocket_t * w)
+{                               // Wake up tx for a websocket
+   websocket_reactor_t *r = w->reactor;
+   if (r)
+   {                            // Event engine, add to kick list
+      pthread_mutex_lock (&r->mutex);
+      if (!w->kicked && !w->dead)
+      {
+         w->kicked = 1;
+         w->knext = r->kick;
+         if (!r->kick)
+            eventfd_write (r->event, 1);
+         r->kick = w;
+      }
+      pthread_mutex_unlock (&r->mutex);
+      return;
+   }
    char poke = 0;
    pthread_mutex_lock (&w->mutex);
    if (w->pipe[1] >= 0)
@@ -271,154 +776,907 @@ txb_queue (websocket_t * w, txb_t * txb)
    pthread_mutex_unlock (&w->mutex);
 }
 
-void *
-websocket_tx (void *p)
-{                               // Tx thread
-   sigignore (SIGPIPE);
-   websocket_t *w = p;
-   void nextq (void)
-   {                            // Unlink queue
-      pthread_mutex_lock (&w->mutex);
-      txq_t *q = (txq_t *) w->txq;
-      w->txq = q->next;
-      pthread_mutex_unlock (&w->mutex);
-      txb_done (q->data);
-      free (q);                 // queue freed
+static int
+txb_queue (websocket_t * w, txb_t * txb)
+{                               // Add a block to a websocket (any thread, lock free), returns 1 if queued, 0 if cannot
+   txq_t *txq = pool_alloc (&pools[POOL_TXQ]);
+   if (!txq)
+      return 0;
+   txq->data = txb;
+   atomic_init (&txq->next, NULL);
+   atomic_fetch_add_explicit (&txb->count, 1, memory_order_relaxed);    // Caller holds a count already
+   atomic_fetch_add_explicit (&w->txbytes, txb->hlen + txb->len, memory_order_relaxed);
+   txq_t *prev = atomic_exchange_explicit (&w->txe, txq, memory_order_acq_rel);
+   atomic_store_explicit (&prev->next, txq, memory_order_release);
+   if (!atomic_fetch_add_explicit (&w->txn, 1, memory_order_acq_rel))
+      websocket_kick (w);       // Only when it was empty, tx sends everything queued before waiting again
+   return 1;
+}
+
+static txq_t *
+txq_first (websocket_t * w)
+{                               // First in queue (tx only), NULL if none (or one still being linked in, see txn)
+   return atomic_load_explicit (&w->txq->next, memory_order_acquire);
+}
+
+static int
+txq_waiting (websocket_t * w)
+{                               // Something to send (tx only)
+   return w->txhs || w->txctl || atomic_load_explicit (&w->ctlq, memory_order_relaxed) || txq_first (w);
+}
+
+static int
+txb_control (websocket_t * w, txb_t * txb)
+{                               // Add a control frame (any thread, lock free), sent between messages or fragments, returns 1 if queued, 0 if cannot
+   txq_t *c = pool_alloc (&pools[POOL_TXQ]);
+   if (!c)
+      return 0;
+   c->data = txb;
+   atomic_fetch_add_explicit (&txb->count, 1, memory_order_relaxed);    // Caller holds a count already
+   txq_t *next = atomic_load_explicit (&w->ctlq, memory_order_relaxed);
+   do
+      atomic_store_explicit (&c->next, next, memory_order_relaxed);
+   while (!atomic_compare_exchange_weak_explicit (&w->ctlq, &next, c, memory_order_release, memory_order_relaxed));
+   websocket_kick (w);
+   return 1;
+}
+
+static void
+txs_fragment (websocket_t * w, txb_t * b)
+{                               // Get the next fragment of a streamed message from the app (tx only)
+   txs_t *s = b->stream;
+   ssize_t n = -1;
+   if (b->buf || (b->buf = malloc (s->fragment)))
+      n = s->cb (s->arg, b->buf, s->fragment);
+   if (n < 0 || (size_t) n > s->fragment)
+   {                            // Cannot finish message, close
+      if (websocket_debug)
+         fprintf (stderr, "Tx stream failed %s\n", w->from);
+      b->len = 0;
+      b->head[0] = 0x88;
+      b->head[1] = 2;
+      b->head[2] = (1011 >> 8); // Internal error
+      b->head[3] = (1011 & 0xFF);
+      b->hlen = 4;
+   } else
+   {                            // Empty fragment marks the end
+      b->len = n;
+      txb_head (b, s->opcode | (n ? 0 : 0x80));
+      s->opcode = 0;            // Continuation from now on
    }
-   time_t nextping = time (0) + 2;
-   while (1)
+   atomic_fetch_add_explicit (&w->txbytes, b->hlen + b->len, memory_order_relaxed);
+}
+
+static void
+conflate_free (websocket_t * w, websocket_conflate_t * c)
+{                               // Unlink and free a conflation key (cmutex locked)
+   websocket_conflate_t **cc;
+   for (cc = &w->conflate[c->hash % CONFLATE]; *cc != c; cc = &(*cc)->next);
+   *cc = c->next;
+   free (c);
+}
+
+static txb_t *
+txq_data (websocket_t * w, txq_t * q)
+{                               // The block for a queue entry, replacing a place holder with the latest for its key (tx only)
+   txb_t *b = q->data;
+   if (!b->conflate)
+      return b;
+   pthread_mutex_lock (&w->cmutex);
+   q->data = b->conflate->txb;  // Already counted in txbytes
+   conflate_free (w, b->conflate);      // Further messages for the key need a new place in the queue
+   pthread_mutex_unlock (&w->cmutex);
+   txb_done (b);
+   return q->data;
+}
+
+static void
+txq_next (websocket_t * w)
+{                               // Unlink first in queue (tx only), it becomes the new head
+   txq_t *q = txq_first (w);
+   txq_data (w, q);
+   if (w->txq != &w->txstub)
+      pool_free (&pools[POOL_TXQ], w->txq);     // Nothing links to old head now its next is set
+   w->txq = q;
+   atomic_fetch_sub_explicit (&w->txbytes, q->data->hlen + q->data->len, memory_order_relaxed);
+   txb_done (q->data);
+   q->data = NULL;
+   atomic_fetch_sub_explicit (&w->txn, 1, memory_order_release);
+}
+
+static int
+txq_over (websocket_t * w, size_t bytes, int msgs)
+{                               // Queue over limits
+   return (w->txmaxbytes && bytes > w->txmaxbytes) || (w->txmaxmsgs && msgs > w->txmaxmsgs);
+}
+
+static int
+txb_room (websocket_t * w, size_t len)
+{                               // Apply queue limits for a new message of len bytes (any thread), returns 1 if it can be queued
+   if (w->txmaxbytes || w->txmaxmsgs)
    {
-      time_t now = time (0);
-      // Send data if we can
-      if (w->connected)
+      size_t bytes = atomic_load_explicit (&w->txbytes, memory_order_relaxed) + len;
+      int msgs = atomic_load_explicit (&w->txn, memory_order_relaxed) + 1;
+      if (txq_over (w, bytes, msgs))
       {
-         if (w->txq)
-         {                      // Data to send
-            ssize_t len = 0;
-            size_t ptr = 0;
-            if (w->txq->data->hlen)
-            {                   // Header
-               if ((w->txq->data->head[0] & 0x0F) == 0x08)
-                  w->closed = 1;        // Sent a close
-               while (ptr < w->txq->data->hlen)
-               {
-                  if (w->ss)
-                     len = SSL_write (w->ss, w->txq->data->head + ptr, w->txq->data->hlen - ptr);
-                  else
-                     len = send (w->socket, w->txq->data->head + ptr, w->txq->data->hlen - ptr, 0);
-                  if (len <= 0)
-                     break;
-                  ptr += len;
-               }
-               if (websocket_debug)
-               {
-                  fprintf (stderr, "Tx Header");
-                  int p;
-                  for (p = 0; p < w->txq->data->hlen; p++)
-                     fprintf (stderr, " %02X", w->txq->data->head[p]);
-                  fprintf (stderr, "\n");
-               }
-            }
-            ptr = 0;
-            while (ptr < w->txq->data->len)
-            {
-               if (w->ss)
-                  len = SSL_write (w->ss, w->txq->data->buf + ptr, w->txq->data->len - ptr);
-               else
-                  len = send (w->socket, w->txq->data->buf + ptr, w->txq->data->len - ptr, 0);
-               if (len <= 0)
-                  break;        // Failed
-               if (websocket_debug)
-                  fprintf (stderr, "Tx [%.*s]\n", (int) len, w->txq->data->buf + ptr);
-               ptr += len;
-            }
-            nextq ();
-            if (w->closed || len <= 0)
-               break;
-            if (w->txq)
-               continue;        // More data
-         } else if (now > nextping)
-         {                      // Send Ping
-            nextping = now + 60;
-            struct timeval tv;
-            struct timezone tz;
-            gettimeofday (&tv, &tz);
-            unsigned long long us = tv.tv_sec * 1000000ULL + tv.tv_usec;;
-            unsigned char ping[2 + sizeof (us)] = { 0x89, sizeof (us) };
-            memcpy (ping + 2, &us, sizeof (us));
-            int p = 0,
-               l = sizeof (ping),
-               len;
-            if (websocket_debug)
-            {
-               fprintf (stderr, "Tx ");
-               for (len = 0; len < l; len++)
-                  fprintf (stderr, " %02X", ping[len]);
-               fprintf (stderr, "\n");
-            }
-            while (p < l)
-            {
-               if (w->ss)
-                  len = SSL_write (w->ss, ping + p, l - p);
-               else
-                  len = send (w->socket, ping + p, l - p, 0);
-               if (len <= 0)
-                  break;
-               p += len;
-            }
-         }
+         unsigned char over = 0;
+         if (atomic_compare_exchange_strong (&w->txover, &over, 1))
+            websocket_kick (w); // Tx to apply policy, even if waiting to be able to write
+         if (w->txpolicy == WEBSOCKET_FULL_CLOSE || w->txpolicy == WEBSOCKET_FULL_DROPNEW
+             || txq_over (w, bytes / 2, (msgs + 1) / 2))
+            return 0;           // Not queued, for drop oldest and notify only when twice over so memory is still bounded
       }
-      struct pollfd p = { w->pipe[0], POLLIN, 0 };
-      int s = poll (&p, 1, (now < nextping) ? (nextping - now) * 1000 : 1000);
-      if (!s)
-         continue;
-      if (s < 0)
-         break;
-      // Wait for new data to be added to queue
-      char poke;
-      ssize_t len = read (w->pipe[0], &poke, sizeof (poke));
-      if (len <= 0)
-         break;                 // Done
    }
-   // Closed our pipe, so closed connection...
-   if (websocket_debug)
-      fprintf (stderr, "Closed connection from %s\n", w->from);
-   while (w->txq)
-      nextq ();                 // free
-   if (w->connected && !w->closed)
-   {                            // close
-      char end[2] = { 0x88, 0x00 };
-      if (w->ss)
-         SSL_write (w->ss, end, 2);
-      else
-         send (w->socket, end, 2, 0);
+   return 1;
+}
+
+static int
+txb_send (websocket_t * w, txb_t * txb)
+{                               // Queue an app message (any thread), applying queue limits, returns 1 if queued
+   if (!txb_room (w, txb->hlen + txb->len))
+      return 0;
+   return txb_queue (w, txb);
+}
+
+size_t
+websocket_txdepth (websocket_t * w, int *msgs)
+{                               // Queue depth
+   if (!w)
+      return 0;
+   if (msgs)
+      *msgs = atomic_load (&w->txn);
+   return atomic_load (&w->txbytes);
+}
+
+void
+websocket_set_txlimit (websocket_t * w, size_t bytes, int msgs, int policy)
+{                               // Queue limits for a connection
+   if (!w)
+      return;
+   w->txmaxbytes = bytes;
+   w->txmaxmsgs = msgs;
+   w->txpolicy = policy;
+}
+
+static unsigned int
+str_hash (const char *t)
+{                               // FNV-1a
+   unsigned int h = 2166136261U;
+   while (*t)
+      h = (h ^ (unsigned char) *t++) * 16777619U;
+   return h;
+}
+
+static unsigned int
+mem_hash (const unsigned char *t, size_t len)
+{                               // FNV-1a, as str_hash
+   unsigned int h = 2166136261U;
+   while (len--)
+      h = (h ^ *t++) * 16777619U;
+   return h;
+}
+
+static void
+txb_send_key (websocket_t * w, txb_t * txb, const char *key)
+{                               // Queue an app message (any thread), replacing any not yet sent with the same key
+   if (!key)
+   {
+      txb_send (w, txb);
+      return;
    }
-   if (w->ss)
-      SSL_shutdown (w->ss);
-   close (w->socket);
+   unsigned int hash = str_hash (key);
+   pthread_mutex_lock (&w->cmutex);
+   if (!w->conflate)
+      w->conflate = calloc (CONFLATE, sizeof (*w->conflate));
+   websocket_conflate_t *c = NULL;
+   if (w->conflate)
+      for (c = w->conflate[hash % CONFLATE]; c && (c->hash != hash || strcmp (c->key, key)); c = c->next);
+   if (!c && w->conflate && (c = malloc (sizeof (*c) + strlen (key) + 1)))
+   {                            // New key
+      c->hash = hash;
+      c->txb = NULL;
+      strcpy (c->key, key);
+      c->next = w->conflate[hash % CONFLATE];
+      w->conflate[hash % CONFLATE] = c;
+   }
+   if (!c)
+   {                            // Malloc failed, just send it
+      pthread_mutex_unlock (&w->cmutex);
+      txb_send (w, txb);
+      return;
+   }
+   txb_t *old = c->txb,
+      *p = NULL;
+   if (old)                     // Replacing, count the difference (unsigned wrap is fine for a smaller one)
+      atomic_fetch_add_explicit (&w->txbytes, (txb->hlen + txb->len) - (old->hlen + old->len), memory_order_relaxed);
+   else if (txb_room (w, txb->hlen + txb->len) && (p = pool_alloc (&pools[POOL_TXB])))
+   {                            // Queue a place holder, which counts as the message it stands for
+      atomic_init (&p->count, 1);
+      p->conflate = c;
+      if (txb_queue (w, p))
+      {                         // Tx cannot resolve it and count it out until we unlock
+         atomic_fetch_add_explicit (&w->txbytes, txb->hlen + txb->len, memory_order_relaxed);
+         old = txb;             // So it is set as latest below
+      } else
+         conflate_free (w, c);  // Not queued
+      txb_done (p);
+   } else
+      conflate_free (w, c);     // Not queued
+   if (old)
+   {                            // Latest
+      atomic_fetch_add_explicit (&txb->count, 1, memory_order_relaxed);
+      c->txb = txb;
+   }
+   pthread_mutex_unlock (&w->cmutex);
+   if (old && old != txb)
+      txb_done (old);           // Replaced
+}
+
+static websocket_topic_t *
+topic_find (unsigned int hash, const char *name)
+{                               // Find a topic (bucket locked)
+   websocket_topic_t *t;
+   for (t = topics[hash % TOPICS].topics; t && (t->hash != hash || strcmp (t->name, name)); t = t->next);
+   return t;
+}
+
+static void
+topic_free (websocket_topic_t * t)
+{                               // Unlink and free a topic with no subscribers (bucket locked)
+   websocket_topic_t **tt;
+   for (tt = &topics[t->hash % TOPICS].topics; *tt != t; tt = &(*tt)->next);
+   *tt = t->next;
+   free (t->subs);
+   free (t);
+}
+
+static void
+topic_remove (websocket_topic_t * t, websocket_t * w)
+{                               // Remove a subscriber, and the topic if it has none left
+   pthread_rwlock_t *lock = &topics[t->hash % TOPICS].lock;
+   pthread_rwlock_wrlock (lock);
+   int i;
+   for (i = 0; i < t->nsubs && t->subs[i] != w; i++);
+   if (i < t->nsubs)
+      t->subs[i] = t->subs[--t->nsubs]; // Order does not matter
+   if (!t->nsubs)
+      topic_free (t);
+   pthread_rwlock_unlock (lock);
+}
+
+const char *
+websocket_subscribe (websocket_t * w, const char *topic)
+{                               // Subscribe a connection to a topic
+   if (!w || !topic)
+      return "Bad subscribe";
+   unsigned int hash = str_hash (topic);
+   pthread_mutex_lock (&w->submutex);
+   websocket_sub_t *s;
+   for (s = w->subs; s && (s->topic->hash != hash || strcmp (s->topic->name, topic)); s = s->next);
+   if (s)
+   {                            // Already subscribed
+      pthread_mutex_unlock (&w->submutex);
+      return NULL;
+   }
+   const char *e = NULL;
+   pthread_rwlock_t *lock = &topics[hash % TOPICS].lock;
+   pthread_rwlock_wrlock (lock);
+   websocket_topic_t *t = topic_find (hash, topic);
+   if (!t && (t = malloc (sizeof (*t) + strlen (topic) + 1)))
+   {                            // New topic
+      memset (t, 0, sizeof (*t));
+      t->hash = hash;
+      strcpy (t->name, topic);
+      t->next = topics[hash % TOPICS].topics;
+      topics[hash % TOPICS].topics = t;
+   }
+   if (!t || !(s = malloc (sizeof (*s))))
+      e = "Malloc fail";
+   else if (t->nsubs == t->maxsubs)
+   {                            // Grow subscribers
+      int max = (t->maxsubs ? t->maxsubs * 2 : 8);
+      websocket_t **subs = realloc (t->subs, max * sizeof (*subs));
+      if (!subs)
+      {
+         free (s);
+         e = "Malloc fail";
+      } else
+      {
+         t->subs = subs;
+         t->maxsubs = max;
+      }
+   }
+   if (!e)
    {
-      // This is to make sure the pipe is closed and not just outgoing broken
-      char poke;
-      while (read (w->pipe[0], &poke, sizeof (poke)) > 0);
+      t->subs[t->nsubs++] = w;
+      s->topic = t;
+      s->next = w->subs;
+      w->subs = s;
+   } else if (t && !t->nsubs)
+      topic_free (t);           // New topic not used
+   pthread_rwlock_unlock (lock);
+   pthread_mutex_unlock (&w->submutex);
+   return e;
+}
+
+const char *
+websocket_unsubscribe (websocket_t * w, const char *topic)
+{                               // Unsubscribe a connection from a topic, or all topics if NULL
+   if (!w)
+      return "Bad unsubscribe";
+   pthread_mutex_lock (&w->submutex);
+   websocket_sub_t **ss = &w->subs;
+   while (*ss)
+   {
+      websocket_sub_t *s = *ss;
+      if (topic && strcmp (s->topic->name, topic))
+      {
+         ss = &s->next;
+         continue;
+      }
+      *ss = s->next;
+      topic_remove (s->topic, w);
+      free (s);
    }
-   pthread_mutex_lock (&w->mutex);
-   if (w->ss)
+   pthread_mutex_unlock (&w->submutex);
+   return NULL;
+}
+
+static ssize_t
+websocket_read (websocket_t * w, void *buf, size_t len)
+{                               // Read from socket, -1 with EAGAIN if would block
+   if (!w->ss)
+      return recv (w->socket, buf, len, 0);
+   ERR_clear_error ();          // Thread's queue may have errors from another connection
+   int l = SSL_read (w->ss, buf, len);
+   if (l > 0)
+      return l;
+   int e = SSL_get_error (w->ss, l);
+   if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE)
+      errno = EAGAIN;
+   else if (e == SSL_ERROR_ZERO_RETURN)
+      return 0;
+   else
+      errno = EPIPE;
+   return -1;
+}
+
+static ssize_t
+websocket_write (websocket_t * w, const void *buf, size_t len)
+{                               // Write to socket, -1 with EAGAIN if would block
+   if (!w->ss)
+      return send (w->socket, buf, len, 0);
+   ERR_clear_error ();
+   if (w->txssl)
+   {                            // OpenSSL needs the same bytes again, they are still the next to send as nothing moves on until done
+      buf = w->txssl;
+      len = w->txssllen;
+   }
+   int l = SSL_write (w->ss, buf, len);
+   if (l > 0)
    {
-      SSL_free (w->ss);
-      w->ss = NULL;
+      free (w->txssl);
+      w->txssl = NULL;
+      return l;
    }
-   w->socket = -1;
-   close (w->pipe[0]);
-   w->pipe[0] = -1;
-   pthread_mutex_unlock (&w->mutex);
+   int e = SSL_get_error (w->ss, l);
+   if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE)
+   {
+      errno = EAGAIN;
+      if (!w->txssl)
+      {                         // Keep what we tried, buf may be on the stack or built differently next time
+         if (!(w->txssl = malloc (len)))
+            errno = ENOMEM;
+         else
+         {
+            memcpy (w->txssl, buf, len);
+            w->txssllen = len;
+         }
+      }
+   } else
+      errno = EPIPE;
+   return -1;
+}
+
+static ssize_t
+websocket_writev (websocket_t * w, struct iovec *iov, int n)
+{                               // Gathered write, one syscall (or one TLS record), -1 with EAGAIN if would block
+   if (!w->ss)
+   {
+      struct msghdr m = {.msg_iov = iov,.msg_iovlen = n };
+      return sendmsg (w->socket, &m, 0);
+   }
+   if (n == 1)
+      return websocket_write (w, iov[0].iov_base, iov[0].iov_len);
+   unsigned char rec[16384];    // Max TLS record
+   size_t len = 0;
+   int i;
+   for (i = 0; i < n && len < sizeof (rec); i++)
+   {
+      size_t l = iov[i].iov_len;
+      if (l > sizeof (rec) - len)
+         l = sizeof (rec) - len;
+      memcpy (rec + len, iov[i].iov_base, l);
+      len += l;
+   }
+   return websocket_write (w, rec, len);
+}
+
+static int
+txb_iov (txb_t * b, size_t ptr, struct iovec *iov)
+{                               // Set iov for header and payload from ptr, returns number used (0 to 2)
+   int n = 0;
+   if (ptr < b->hlen)
+   {
+      iov[n].iov_base = b->head + ptr;
+      iov[n++].iov_len = b->hlen - ptr;
+   }
+   size_t o = (ptr > b->hlen ? ptr - b->hlen : 0);
+   if (o < b->len)
+   {
+      iov[n].iov_base = b->buf + o;
+      iov[n++].iov_len = b->len - o;
+   }
+   return n;
+}
+
+typedef struct txzs_s txzs_t;
+struct txzs_s
+{                               // A thread's deflate for messages compressed once and shared
+   z_stream z;
+   int level,
+     bits,
+     mem;
+};
+static __thread txzs_t *txzs;
+static pthread_key_t txzskey;
+static pthread_once_t txzsonce = PTHREAD_ONCE_INIT;
+
+static void
+txzs_exit (void *v)
+{                               // Thread exit
+   txzs_t *t = v;
+   deflateEnd (&t->z);
+   free (t);
+}
+
+static void
+txzs_key (void)
+{
+   pthread_key_create (&txzskey, txzs_exit);
+}
+
+static z_stream *
+txzs_get (websocket_path_t * path)
+{                               // This thread's shared message deflate, set up for the path settings, NULL if cannot
+   txzs_t *t = txzs;
+   if (t && (t->level != path->deflate || t->bits != path->deflatebits || t->mem != path->deflatemem))
+   {                            // Different settings
+      deflateEnd (&t->z);
+      if (deflateInit2 (&t->z, path->deflate, Z_DEFLATED, -path->deflatebits, path->deflatemem, Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+         pthread_setspecific (txzskey, NULL);
+         free (t);
+         txzs = NULL;
+         return NULL;
+      }
+   } else if (!t)
+   {                            // First use
+      pthread_once (&txzsonce, txzs_key);
+      if (!(t = calloc (1, sizeof (*t))))
+         return NULL;
+      if (deflateInit2 (&t->z, path->deflate, Z_DEFLATED, -path->deflatebits, path->deflatemem, Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+         free (t);
+         return NULL;
+      }
+      txzs = t;
+      pthread_setspecific (txzskey, t);
+   }
+   t->level = path->deflate;
+   t->bits = path->deflatebits;
+   t->mem = path->deflatemem;
+   return &t->z;
+}
+
+static txb_t *
+txb_deflate (txb_t * b, z_stream * z, int bits, int takeover)
+{                               // Make a compressed copy of a whole message (RFC7692), NULL if failed
+   size_t max = deflateBound (z, b->len) + 16,
+      len = 0;
+   unsigned char *buf = malloc (max);
+   if (!buf)
+      return NULL;
+   z->next_in = b->buf;
+   z->avail_in = b->len;
+   while (1)
+   {
+      z->next_out = buf + len;
+      z->avail_out = max - len;
+      int r = deflate (z, Z_SYNC_FLUSH);
+      len = max - z->avail_out;
+      if (r != Z_OK && r != Z_BUF_ERROR)
+      {
+         free (buf);
+         deflateReset (z);
+         return NULL;
+      }
+      if (z->avail_out)
+         break;                 // All flushed
+      unsigned char *n = realloc (buf, max *= 2);
+      if (!n)
+      {
+         free (buf);
+         deflateReset (z);
+         return NULL;
+      }
+      buf = n;
+   }
+   if (len >= 4 && !memcmp (buf + len - 4, "\0\0\xFF\xFF", 4))
+      len -= 4;                 // Sync flush marker is left for the far end to add
+   if (!takeover)
+      deflateReset (z);
+   txb_t *d = txb_new_data (len, buf);
+   if (!d)
+   {
+      free (buf);
+      return NULL;
+   }
+   txb_head (d, 0xC0 | (b->head[0] & 0x0F));    // FIN and RSV1 (compressed)
+   d->zbits = bits;
+   return d;
+}
+
+static txb_t *
+txq_deflate (websocket_t * w, txq_t * q)
+{                               // Compress a message about to be sent, if agreed and worth it (tx only), returns the block to send
+   txb_t *b = q->data,
+      *d = NULL;
+   websocket_pmd_t *z = w->pmd;
+   websocket_path_t *path = w->path;
+   if (!z || (b->head[0] & 0xF0) != 0x80 || ((b->head[0] & 0x0F) != 1 && (b->head[0] & 0x0F) != 2) || b->stream
+       || b->len < path->deflatemin || b->len > UINT_MAX)
+      return b;                 // Not a whole data message, already compressed, or too small
+   if (!z->takeover)
+   {                            // Compress once for every connection it is sent to
+      if (!(d = atomic_load_explicit (&b->deflated, memory_order_acquire)))
+      {
+         z_stream *s = txzs_get (path);
+         txb_t *e = NULL;
+         if (!s || !(d = txb_deflate (b, s, path->deflatebits, 0)))
+            return b;
+         if (d->len >= b->len)
+         {                      // Not worth it, so no others try
+            txb_done (d);
+            d = b;
+         }
+         if (!atomic_compare_exchange_strong (&b->deflated, &e, d))
+         {                      // Another connection got there first
+            if (d != b)
+               txb_done (d);
+            d = e;
+         }
+      }
+      if (d == b)
+         return b;
+      if (d->zbits > z->txbits)
+         d = NULL;              // Far end wants a smaller window, compressed for this connection
+      else
+         atomic_fetch_add_explicit (&d->count, 1, memory_order_relaxed);
+   }
+   if (!d)
+   {                            // Compress with this connection's context
+      if (!z->txinit)
+      {
+         if (deflateInit2 (&z->tx, path->deflate, Z_DEFLATED, -z->txbits, path->deflatemem, Z_DEFAULT_STRATEGY) != Z_OK)
+            return b;
+         z->txinit = 1;
+      }
+      if (!(d = txb_deflate (b, &z->tx, z->txbits, z->takeover)))
+         return b;              // Context was reset, which the far end can still follow
+      if (!z->takeover && d->len >= b->len)
+      {                         // Not worth it
+         txb_done (d);
+         return b;
+      }
+   }
+   q->data = d;
+   atomic_fetch_add_explicit (&w->txbytes, d->hlen + d->len, memory_order_relaxed);
+   atomic_fetch_sub_explicit (&w->txbytes, b->hlen + b->len, memory_order_relaxed);
+   txb_done (b);
+   return d;
+}
+
+static void
+websocket_txlimit (websocket_t * w)
+{                               // Apply queue limit policy between messages (tx only), not while a message is part sent or a TLS write pending
+   if ((!w->txmaxbytes && !w->txmaxmsgs) || w->txhs || w->txptr || w->txssl || w->closed)
+      return;
+   if (w->txpolicy == WEBSOCKET_FULL_CLOSE)
+   {
+      unsigned char over = 1;
+      if (atomic_compare_exchange_strong (&w->txover, &over, 2))
+      {                         // Discard queue and close
+         if (websocket_debug)
+            fprintf (stderr, "Tx queue full, closing %s\n", w->from);
+         while (txq_first (w))
+            txq_next (w);
+         txb_t *txb = txb_new_close (1008);     // Policy violation
+         if (!txb || !txb_queue (w, txb))
+            shutdown (w->socket, SHUT_RDWR);    // Cannot say why, just end it
+         if (txb)
+            txb_done (txb);
+      }
+      return;
+   }
+   txq_t *q;
+   while (txq_over (w, atomic_load (&w->txbytes), atomic_load (&w->txn)))
+   {
+      if (w->txpolicy == WEBSOCKET_FULL_NOTIFY)
+      {
+         if (!w->txnotified)
+         {
+            w->txnotified = 1;
+            if (w->path && w->path->callbackfull)
+               w->path->callbackfull (w, atomic_load (&w->txbytes), atomic_load (&w->txn));
+         }
+         return;
+      }
+      txb_t *b = NULL;
+      if (w->txpolicy != WEBSOCKET_FULL_DROPOLD || !(q = txq_first (w)) || ((b = txq_data (w, q))->head[0] & 0x0F) == 0x08
+          || (b->stream && !b->stream->opcode) || ((b->head[0] & 0x40) && w->pmd->takeover)
+          || !atomic_load_explicit (&q->next, memory_order_acquire))
+         return;                // Cannot drop a close, stream part sent, message in the compression context, or the newest
+      txq_next (w);             // Drop oldest
+   }
+   w->txnotified = 0;
+   atomic_store (&w->txover, 0);
+}
+
+static int
+websocket_txq_iov (websocket_t * w, struct iovec *iov, txb_t ** iovb, int max)
+{                               // Set iov (and iovb to the block for each, if not NULL) for queued messages from txptr up to txbudget,
+   // stopping after a close, returns number used
+   websocket_txlimit (w);
+   size_t len = 0,
+      p = w->txptr;
+   int n = 0;
+   if (w->txhs)
+   {
+      n = txb_iov (w->txhs, p, iov);
+      len = w->txhs->len - p;
+      p = 0;
+      if (iovb)
+         iovb[0] = iovb[1] = w->txhs;
+   } else if (!p && !w->txssl && atomic_load_explicit (&w->ctlq, memory_order_relaxed))
+   {                            // Control frames go next, between messages or fragments, not while a TLS write is to be retried
+      txq_t *c = atomic_exchange_explicit (&w->ctlq, NULL, memory_order_acquire),
+         *r = NULL,
+         **e = &w->txctl;
+      while (c)
+      {                         // Reverse in to order sent
+         txq_t *next = atomic_load_explicit (&c->next, memory_order_relaxed);
+         atomic_store_explicit (&c->next, r, memory_order_relaxed);
+         r = c;
+         c = next;
+      }
+      while (*e)
+         e = (txq_t **) & (*e)->next;
+      *e = r;
+   }
+   txq_t *c;
+   for (c = w->txctl; c && n + 2 <= max; c = atomic_load_explicit (&c->next, memory_order_relaxed))
+   {
+      int i = txb_iov (c->data, p, iov + n);
+      while (i--)
+      {
+         if (iovb)
+            iovb[n] = c->data;
+         len += iov[n++].iov_len;
+      }
+      p = 0;
+   }
+   txq_t *q = (c ? NULL : txq_first (w));
+   while (q && n + 2 <= max && (!n || len < w->bind->txbudget))
+   {
+      txb_t *b = txq_data (w, q);
+      if (b->stream && !b->hlen)
+         txs_fragment (w, b);
+      else if (!p && w->pmd)
+         b = txq_deflate (w, q);
+      int i = txb_iov (b, p, iov + n);
+      while (i--)
+      {
+         if (iovb)
+            iovb[n] = b;
+         len += iov[n++].iov_len;
+      }
+      p = 0;
+      if (b->hlen && (b->head[0] & 0x0F) == 0x08)
+         break;                 // Close, nothing more after that
+      if (b->stream)
+         break;                 // Next fragment made once this is sent
+      q = atomic_load_explicit (&q->next, memory_order_acquire);
+   }
+   return n;
+}
+
+static ssize_t
+websocket_txq_write (websocket_t * w)
+{                               // Write as much of the queue as we can in one go, -1 with EAGAIN if would block
+   struct iovec iov[TXIOV];
+   txb_t *iovb[TXIOV];
+   int n = websocket_txq_iov (w, iov, iovb, TXIOV),
+      i,
+      zc = 0;
+   if (!n)
+      return 0;                 // Nothing to send just now
+   for (i = 0; w->zc && i < n; i++)
+   {
+      if (iovb[i]->stream)
+      {                         // Fragment buffer is reused, so cannot be left with the kernel
+         zc = 0;
+         break;
+      }
+      if (iov[i].iov_len >= w->bind->zerocopy)
+         zc = 1;
+   }
+   txz_t *z;
+   if (!zc || !(z = malloc (sizeof (*z) + n * sizeof (*z->b))))
+      return websocket_writev (w, iov, n);
+   struct msghdr m = {.msg_iov = iov,.msg_iovlen = n };
+   ssize_t len = sendmsg (w->socket, &m, MSG_ZEROCOPY);
+   if (len < 0 && errno == ENOBUFS)
+      len = sendmsg (w->socket, &m, 0); // Cannot pin more just now
+   else if (len > 0)
+   {                            // Hold blocks sent until the kernel says it is done with them
+      z->next = NULL;
+      z->seq = w->zcseq++;
+      z->n = 0;
+      size_t l = len;
+      for (i = 0; i < n && l; i++)
+      {
+         if (!z->n || z->b[z->n - 1] != iovb[i])
+         {
+            z->b[z->n++] = iovb[i];
+            atomic_fetch_add_explicit (&iovb[i]->count, 1, memory_order_relaxed);
+         }
+         l -= (l < iov[i].iov_len ? l : iov[i].iov_len);
+      }
+      if (w->zcq)
+         w->zce->next = z;
+      else
+         w->zcq = z;
+      w->zce = z;
+      return len;
+   }
+   free (z);
+   return len;
+}
+
+static int
+websocket_zc_done (websocket_t * w)
+{                               // Release blocks the kernel has finished with (MSG_ZEROCOPY), returns how many sends
+   int done = 0;
+   while (w->zcq)
+   {
+      unsigned char control[CMSG_SPACE (sizeof (struct sock_extended_err))];
+      struct msghdr m = {.msg_control = control,.msg_controllen = sizeof (control) };
+      if (recvmsg (w->socket, &m, MSG_ERRQUEUE) < 0)
+         break;
+      struct cmsghdr *c;
+      for (c = CMSG_FIRSTHDR (&m); c; c = CMSG_NXTHDR (&m, c))
+      {
+         struct sock_extended_err *e = (void *) CMSG_DATA (c);
+         if (e->ee_errno || e->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+         txz_t **zz = &w->zcq,
+            *z;
+         w->zce = NULL;
+         while ((z = *zz))
+         {
+            if (z->seq - e->ee_info > e->ee_data - e->ee_info)
+            {                   // Not in range lo (info) to hi (data)
+               w->zce = z;
+               zz = &z->next;
+               continue;
+            }
+            *zz = z->next;
+            while (z->n--)
+               txb_done (z->b[z->n]);
+            free (z);
+            done++;
+         }
+      }
+   }
+   return done;
+}
+
+static void
+websocket_sent (websocket_t * w, size_t len)
+{                               // Bytes of txq sent, move on through the queue (or HTTP response if not connected)
+   if (!w->connected)
+   {
+      w->txptr += len;
+      return;
+   }
+   while (len)
+   {
+      txq_t *q = NULL,
+         *c = NULL;
+      txb_t *b = w->txhs;
+      if (!b && (c = w->txctl))
+         b = c->data;
+      if (!b && (q = txq_first (w)))
+         b = txq_data (w, q);
+      if (!b)
+         break;
+      size_t left = b->hlen + b->len - w->txptr;
+      if (len < left)
+      {
+         w->txptr += len;
+         return;
+      }
+      len -= left;
+      if (websocket_debug)
+         fprintf (stderr, "Tx %02X [%.*s]\n", b->head[0], (int) b->len, b->buf);
+      if (b->hlen && (b->head[0] & 0x0F) == 0x08)
+         w->closed = 1;         // Sent a close
+      w->txptr = 0;
+      if (c)
+      {                         // Control frame sent
+         w->txctl = atomic_load_explicit (&c->next, memory_order_relaxed);
+         txb_done (c->data);
+         pool_free (&pools[POOL_TXQ], c);
+      } else if (q && b->stream && !(b->head[0] & 0x80))
+      {                         // Fragment sent, more to come
+         atomic_fetch_sub_explicit (&w->txbytes, b->hlen + b->len, memory_order_relaxed);
+         b->hlen = 0;
+         b->len = 0;
+      } else if (q)
+         txq_next (w);
+      else
+      {
+         txb_done (w->txhs);
+         w->txhs = NULL;
+      }
+   }
+}
+
+static txb_t *
+txb_new_ping (void)
+{                               // Make a ping block with current time (count set to 1), NULL if cannot
+   struct timeval tv;
+   struct timezone tz;
+   gettimeofday (&tv, &tz);
+   unsigned long long us = tv.tv_sec * 1000000ULL + tv.tv_usec;;
+   unsigned char *buf = malloc (sizeof (us));
+   if (!buf)
+      return NULL;
+   memcpy (buf, &us, sizeof (us));
+   txb_t *txb = txb_new_data (sizeof (us), buf);
+   if (!txb)
+   {
+      free (buf);
+      return NULL;
+   }
+   txb->head[0] = 0x89;         // Ping
+   return txb;
+}
+
+static void
+websocket_close_callback (websocket_t * w)
+{                               // Tell app the websocket has closed
+   if (!w->connected)
+      return;
 #ifdef	USEAXL
-   if (w->path && w->path->callbackxmlraw && w->connected)
+   if (w->path && w->path->callbackxmlraw)
    {
       if (websocket_debug)
          fprintf (stderr, "%p Close callback\n", w);
       w->path->callbackxmlraw (w, NULL, 0, NULL);       // Closed (we do not consider returned error)
    }
-   if (w->path && w->path->callbackxml && w->connected)
+   if (w->path && w->path->callbackxml)
    {
       if (websocket_debug)
          fprintf (stderr, "%p Close callback\n", w);
@@ -426,142 +1684,1289 @@ websocket_tx (void *p)
    }
 #endif
 #ifdef	USEAJL
-   if (w->path && w->path->callbackjsonraw && w->connected)
+   if (w->path && w->path->callbackjsonraw)
    {
       if (websocket_debug)
          fprintf (stderr, "%p Close callback\n", w);
       w->path->callbackjsonraw (w, NULL, 0, NULL);      // Closed (we do not consider returned error)
    }
-   if (w->path && w->path->callbackjson && w->connected)
+   if (w->path && w->path->callbackjson)
    {
       if (websocket_debug)
          fprintf (stderr, "%p Close callback\n", w);
       w->path->callbackjson (w, NULL, NULL);    // Closed (we do not consider returned error)
    }
 #endif
-   free (w->from);
-   // Free web socket
-   pthread_mutex_lock (&w->bind->mutex);
-   websocket_t **ww;
-   for (ww = (websocket_t **) & w->bind->sessions; *ww && *ww != w; ww = (websocket_t **) & (*ww)->next);
-   *ww = (websocket_t *) w->next;
-   pthread_mutex_unlock (&w->bind->mutex);
-   free (w);
-   pthread_exit (NULL);
-   return NULL;
 }
 
-char *
-websocket_do_rx (websocket_t * w)
-{                               // Rx thread
-   if (w->bind->keyfile)
-   {                            // SSL set up
-      w->ss = SSL_new (w->bind->ctx);
-      if (!w->ss)
-         return "Cannot create SSL server structure";
-      if (!SSL_set_fd (w->ss, w->socket))
-         return "Could not set client SSL fd";
-      if (w->bind->certfile)
-      {
-         int e = SSL_CTX_use_certificate_chain_file (w->bind->ctx, w->bind->certfile);
-         if (e != 1)
-            return "Cannot load cert file";
-      }
-      if (w->bind->keyfile)
-      {
-         int e = SSL_CTX_use_PrivateKey_file (w->bind->ctx, w->bind->keyfile, SSL_FILETYPE_PEM);
-         if (e != 1)
-            return "Cannot load key file";
-      }
-      int r = SSL_accept (w->ss);
-      if (r != 1)
-         return "Could not establish SSL client connection";
-   }
-   {                            // Rx initial handshake
-      unsigned int ep = 0;
-      while (1)
-      {
-         if (!w->ss || !SSL_peek (w->ss, &(char)
-                                  { 0 }, 1))
-         {
-            struct pollfd p = { w->socket, POLLIN, 0 };
-            int s = poll (&p, 1, 10000);
-            if (s <= 0)
-            {
-               if (websocket_debug)
-                  fprintf (stderr, "Rx handshake [%.*s]\n", (int) w->rxptr, w->rxdata);
-               return "Handshake timeout";
-            }
-         }
-         if (w->rxlen - w->rxptr < 1000)
-            w->rxdata = realloc (w->rxdata, w->rxlen += 1000);
-         ssize_t len = 0;
-         if (w->ss)
-            len = SSL_read (w->ss, w->rxdata + w->rxptr, w->rxlen - w->rxptr - 1);
-         else
-            len = recv (w->socket, w->rxdata + w->rxptr, w->rxlen - w->rxptr - 1, 0);
-         if (len <= 0)
-            return "Connection closed in handshake";
-         w->rxptr += len;
-         if (w->rxptr < 4)
-            continue;
-         while (ep <= w->rxptr - 4
-                && (w->rxdata[ep + 0] != '\r' || w->rxdata[ep + 1] != '\n' || w->rxdata[ep + 2] != '\r'
-                    || w->rxdata[ep + 3] != '\n'))
-            ep++;
-         if (ep <= w->rxptr - 4)
-            break;
-      }
-      if (websocket_debug)
-         fprintf (stderr, "Rx handshake [%.*s]\n", (int) ep, w->rxdata);
-      // Process headers
-      unsigned char *e = w->rxdata + ep + 2;
-      ep += 4;
-      // The command (GET/POST/etc)
-      unsigned char *p;
-      for (p = w->rxdata; p < e && isalpha (*p); p++)
-         *p = tolower (*p);
-      if (p >= e || *p != ' ')
-         return "Bad request";
-      while (p < e && *p == ' ')
-         *p++ = 0;
-      unsigned char *eol = p;
-      while (eol < e && *eol > ' ')
-         eol++;
-      if (eol == p)
-         return "Bad request";
-      while (eol < e && *eol >= ' ')
-         *eol++ = 0;
-      if (eol < e && *eol == '\r')
-         *eol++ = 0;
-      if (eol < e && *eol == '\n')
-         *eol++ = 0;
+static char *
+websocket_callback (websocket_t * w, websocket_job_t * j)
+{                               // Pass a received message to the app, returns error
+   if (websocket_debug)
+      fprintf (stderr, "%p Data callback\n", w);
 #ifdef	USEAXL
-      xml_t xhead = xml_tree_new ((char *) w->rxdata);
+   if (j->data && w->path->callbackxmlraw)
+      return w->path->callbackxmlraw (w, NULL, j->len, j->data);
+   if (j->xml)
+      return w->path->callbackxml (w, NULL, j->xml);    // XML is consumed
 #endif
 #ifdef	USEAJL
-      j_t jhead = j_create ();
-      j_store_string (jhead, "method", (char *) w->rxdata);
+   if (j->data && w->path->callbackjsonraw)
+      return w->path->callbackjsonraw (w, NULL, j->len, j->data);
+   if (j->json)
+      return w->path->callbackjson (w, NULL, j->json);  // JSON is consumed
 #endif
+   return NULL;
+}
 
-      char *url = (char *) p;
-      char *query = NULL;
-      for (query = url; *query && *query != '?'; query++);
-      if (*query == '?')
-      {                         // decode query args and add to header too
-         *query++ = 0;
+static void
+websocket_rx_free (websocket_t * w, unsigned char *data, int app)
+{                               // Free a received message buffer, back to the app if it came from its rxalloc
+   if (app && data)
+      w->path->callbackrxalloc (w, data, 0);
+   else
+      free (data);
+}
+
+static void
+websocket_job_free (websocket_t * w, websocket_job_t * j)
+{                               // Discard the data of a job not passed to the app
+   websocket_rx_free (w, j->data, w->path->callbackrxalloc ? 1 : 0);    // Raw data always uses rxalloc if set
 #ifdef	USEAXL
-         xml_t xq = xhead;
-         xq = xml_add (xhead, "query", query);  // New format creates query as sub object of head
+   if (j->xml)
+      xml_tree_delete (j->xml);
 #endif
 #ifdef	USEAJL
-         j_t jq = j_store_object (jhead, "query");
+   if (j->json)
+      j_delete (&j->json);
 #endif
-         while (*query)
-         {                      // URL decode
-            char *p = query,
-               *v = NULL;
-            while (*p && *p != '=' && *p != '&')
+}
+
+static void
+websocket_free (websocket_t * w)
+{                               // Unlink and free
+   pthread_mutex_lock (&w->bind->mutex);
+   websocket_t **ww;
+   for (ww = (websocket_t **) & w->bind->sessions; *ww && *ww != w; ww = (websocket_t **) & (*ww)->next);
+   *ww = (websocket_t *) w->next;
+   pthread_mutex_unlock (&w->bind->mutex);
+   websocket_unsubscribe (w, NULL);
+   // Now unlinked nothing more can be queued
+   while (txq_first (w))
+      txq_next (w);             // free
+   if (w->txq != &w->txstub)
+      pool_free (&pools[POOL_TXQ], w->txq);
+   txq_t *c,
+    *ctl[2] = { w->txctl, atomic_exchange (&w->ctlq, NULL) };
+   int i;
+   for (i = 0; i < 2; i++)
+      while ((c = ctl[i]))
+      {
+         ctl[i] = atomic_load_explicit (&c->next, memory_order_relaxed);
+         txb_done (c->data);
+         pool_free (&pools[POOL_TXQ], c);
+      }
+   free (w->txssl);
+   while (w->zcq)
+   {                            // Socket is closed now so kernel has finished with them
+      txz_t *z = w->zcq;
+      w->zcq = z->next;
+      while (z->n--)
+         txb_done (z->b[z->n]);
+      free (z);
+   }
+   if (w->conflate)
+   {                            // Place holders are gone so nothing waiting
+      int i;
+      for (i = 0; i < CONFLATE; i++)
+         while (w->conflate[i])
+         {
+            websocket_conflate_t *c = w->conflate[i];
+            w->conflate[i] = c->next;
+            free (c);
+         }
+      free (w->conflate);
+   }
+   if (w->txhs)
+      txb_done (w->txhs);
+   if (w->txres)
+      txb_done (w->txres);
+   websocket_rx_free (w, w->rxdata, w->rxapp);
+   free (w->rxbuf);
+#ifdef	USEAJL
+   if (w->rxjson)
+   {
+      if (w->rxjson->json)
+         j_delete (&w->rxjson->json);
+      free (w->rxjson->stack);
+      free (w->rxjson->tok);
+      free (w->rxjson->name);
+      free (w->rxjson);
+   }
+#endif
+   if (w->pmd)
+   {
+      if (w->pmd->txinit)
+         deflateEnd (&w->pmd->tx);
+      if (w->pmd->rxinit)
+         inflateEnd (&w->pmd->rx);
+      free (w->pmd->out);
+      free (w->pmd);
+   }
+#ifdef	USEURING
+   free (w->txmsg);
+#endif
+   pool_free (&pools[POOL_WS], w);
+}
+
+static int
+websocket_work (websocket_t * w, websocket_job_t * j)
+{                               // Queue a job for callback workers (j is copied, NULL for closed), rx threads wait if full, returns 1 if full (event engine), -1 if cannot queue
+   websocket_job_t *q = NULL;
+   if (j)
+   {
+      if (!(q = malloc (sizeof (*q))))
+         return -1;
+      *q = *j;
+      q->next = NULL;
+   }
+   pthread_mutex_lock (&workmutex);
+   if (!q)
+      w->wclose = 1;            // Last, no allocation so always done
+   else
+   {
+      if (w->jobq)
+         w->jobe->next = q;
+      else
+         w->jobq = q;
+      w->jobe = q;
+      w->jobs++;
+   }
+   if (!w->wsched)
+   {                            // Schedule
+      w->wsched = 1;
+      w->wnext = NULL;
+      if (workq)
+         worke->wnext = w;
+      else
+         workq = w;
+      worke = w;
+      pthread_cond_signal (&workcond);
+   }
+   if (!w->reactor && q)
+      while (w->jobs >= workmax)
+         pthread_cond_wait (&workspace, &workmutex);    // Backpressure, stop reading this socket
+   int full = (w->jobs >= workmax);
+   pthread_mutex_unlock (&workmutex);
+   return full;
+}
+
+static int
+websocket_work_full (websocket_t * w)
+{                               // Too many jobs waiting
+   pthread_mutex_lock (&workmutex);
+   int full = (w->jobs >= workmax);
+   pthread_mutex_unlock (&workmutex);
+   return full;
+}
+
+void *
+websocket_worker (void *p)
+{                               // Callback worker thread, one job at a time per connection so they are in order
+   sigignore (SIGPIPE);
+   (void) p;
+   pthread_mutex_lock (&workmutex);
+   while (1)
+   {
+      websocket_t *w = workq;
+      if (!w)
+      {
+         pthread_cond_wait (&workcond, &workmutex);
+         continue;
+      }
+      workq = w->wnext;
+      if (!workq)
+         worke = NULL;
+      websocket_job_t *j = w->jobq;
+      if (!j)
+      {                         // Closed and no jobs left, nothing else references w now
+         pthread_mutex_unlock (&workmutex);
+         websocket_close_callback (w);
+         websocket_free (w);
+         pthread_mutex_lock (&workmutex);
+         continue;
+      }
+      w->jobq = j->next;
+      int resume = (w->jobs-- == workmax);
+      if (resume)
+         pthread_cond_broadcast (&workspace);
+      int fail = w->wfail;
+      pthread_mutex_unlock (&workmutex);
+      if (resume && w->reactor)
+         websocket_kick (w);    // Reactor to start reading again
+      char *e = NULL;
+      if (fail)
+         websocket_job_free (w, j);
+      else
+         e = websocket_callback (w, j);
+      free (j);
+      if (e)
+      {                         // Close connection
+         if (websocket_debug)
+            fprintf (stderr, "Rx socket response: %s\n", e);
+         if (*e == '*' || *e == '@' || *e == '>')
+            free (e);           // Malloc'd
+         txb_t *txb = txb_new_data (0, NULL);
+         if (!txb || !txb_queue (w, txb))
+            shutdown (w->socket, SHUT_RDWR);    // Cannot close cleanly, just end it
+         if (txb)
+            txb_done (txb);
+      }
+      pthread_mutex_lock (&workmutex);
+      if (e)
+         w->wfail = 1;
+      if (w->jobq || w->wclose)
+      {                         // More for this connection, back of the queue
+         w->wnext = NULL;
+         if (workq)
+            worke->wnext = w;
+         else
+            workq = w;
+         worke = w;
+      } else
+         w->wsched = 0;
+   }
+   return NULL;
+}
+
+static const char *
+websocket_workers_start (int n, int max)
+{                               // Start callback worker threads (once)
+   if (workers)
+      return NULL;
+   workmax = max;
+   int i;
+   for (i = 0; i < n; i++)
+   {
+      pthread_t t;
+      if (pthread_create (&t, NULL, websocket_worker, NULL))
+         return "Thread create error";
+      pthread_detach (t);
+   }
+   workers = n;
+   return NULL;
+}
+
+static void
+websocket_end (websocket_t * w)
+{                               // Socket closed, tell app, unlink and free
+   if (w->bind->workers && w->connected)
+   {                            // After any callbacks still waiting
+      websocket_work (w, NULL);
+      return;
+   }
+   websocket_close_callback (w);
+   websocket_free (w);
+}
+
+void *
+websocket_tx (void *p)
+{                               // Tx thread
+   sigignore (SIGPIPE);
+   websocket_t *w = p;
+   time_t nextping = time (0) + 2;
+   while (1)
+   {
+      time_t now = time (0);
+      // Send data if we can
+      if (w->connected)
+      {
+         atomic_thread_fence (memory_order_acquire);    // See txhs set before connected
+         if (txq_waiting (w))
+         {                      // Data to send, as much of the queue as we can in one write
+            ssize_t len = websocket_txq_write (w);
+            if (len < 0)
+               break;           // Failed
+            if (len)
+            {
+               websocket_sent (w, len);
+               if (w->closed)
+                  break;
+               if (atomic_load (&w->txn))
+                  continue;     // More data
+            }
+         } else if (atomic_load (&w->txn))
+         {                      // Being linked in, no further wake up for it
+            sched_yield ();
+            continue;
+         } else if (now > nextping)
+         {                      // Send Ping
+            nextping = now + 60;
+            struct timeval tv;
+            struct timezone tz;
+            gettimeofday (&tv, &tz);
+            unsigned long long us = tv.tv_sec * 1000000ULL + tv.tv_usec;;
+            unsigned char ping[2 + sizeof (us)] = { 0x89, sizeof (us) };
+            memcpy (ping + 2, &us, sizeof (us));
+            int p = 0,
+               l = sizeof (ping),
+               len;
+            if (websocket_debug)
+            {
+               fprintf (stderr, "Tx ");
+               for (len = 0; len < l; len++)
+                  fprintf (stderr, " %02X", ping[len]);
+               fprintf (stderr, "\n");
+            }
+            while (p < l)
+            {
+               len = websocket_write (w, ping + p, l - p);
+               if (len <= 0)
+                  break;
+               p += len;
+            }
+         }
+      }
+      struct pollfd p[2] = { {w->pipe[0], POLLIN, 0}, {w->socket, 0, 0} };      // Socket for POLLERR if zero copy sends waiting
+      int s = poll (p, w->zcq ? 2 : 1, (now < nextping) ? (nextping - now) * 1000 : 1000);
+      if (!s)
+         continue;
+      if (s < 0)
+         break;
+      if (p[1].revents & POLLERR)
+      {                         // Zero copy sends done (or socket error)
+         if (!websocket_zc_done (w))
+            break;
+         if (!(p[0].revents & POLLIN))
+            continue;
+      }
+      // Wait for new data to be added to queue, one read for all pokes since
+      char poke[64];
+      ssize_t len = read (w->pipe[0], poke, sizeof (poke));
+      if (len <= 0)
+         break;                 // Done
+   }
+   // Closed our pipe, so closed connection...
+   if (websocket_debug)
+      fprintf (stderr, "Closed connection from %s\n", w->from);
+   if (w->connected && !w->closed)
+   {                            // close
+      char end[2] = { 0x88, 0x00 };
+      websocket_write (w, end, 2);
+   }
+   if (w->ss)
+      SSL_shutdown (w->ss);
+   close (w->socket);
+   {
+      // This is to make sure the pipe is closed and not just outgoing broken
+      char poke;
+      while (read (w->pipe[0], &poke, sizeof (poke)) > 0);
+   }
+   pthread_mutex_lock (&w->mutex);
+   if (w->ss)
+   {
+      SSL_free (w->ss);
+      w->ss = NULL;
+   }
+   w->socket = -1;
+   close (w->pipe[0]);
+   w->pipe[0] = -1;
+   pthread_mutex_unlock (&w->mutex);
+   websocket_end (w);
+   pthread_exit (NULL);
+   return NULL;
+}
+
+static char *
+websocket_ssl (websocket_t * w)
+{                               // SSL set up
+   if (w->bind->certfile)
+   {
+      int e = SSL_CTX_use_certificate_chain_file (w->bind->ctx, w->bind->certfile);
+      if (e != 1)
+         return "Cannot load cert file";
+   }
+   if (w->bind->keyfile)
+   {
+      int e = SSL_CTX_use_PrivateKey_file (w->bind->ctx, w->bind->keyfile, SSL_FILETYPE_PEM);
+      if (e != 1)
+         return "Cannot load key file";
+   }
+   // Create after loading cert/key as SSL takes a copy from the context
+   w->ss = SSL_new (w->bind->ctx);
+   if (!w->ss)
+      return "Cannot create SSL server structure";
+   if (!SSL_set_fd (w->ss, w->socket))
+      return "Could not set client SSL fd";
+   return NULL;
+}
+
+typedef struct rng_s rng_t;
+struct rng_s
+{                               // A thread's ChaCha20 output, the key is replaced from each batch so used output cannot be recreated
+   uint32_t key[8];
+   unsigned int gen;            // Fork generation seeded in
+   unsigned short pos;          // Next unused byte in buf
+   unsigned char seeded:1;
+   unsigned char buf[RNGBLOCKS * 64];
+};
+static __thread rng_t rng;
+static _Atomic unsigned int rnggen;     // Changed in a forked child, so it does not repeat its parent's output
+static pthread_once_t rngonce = PTHREAD_ONCE_INIT;
+
+static void
+rng_fork (void)
+{
+   rnggen++;
+}
+
+static void
+rng_atfork (void)
+{
+   pthread_atfork (NULL, NULL, rng_fork);
+}
+
+#define	QR(a,b,c,d)	(a+=b,d^=a,d=(d<<16)|(d>>16),c+=d,b^=c,b=(b<<12)|(b>>20),a+=b,d^=a,d=(d<<8)|(d>>24),c+=d,b^=c,b=(b<<7)|(b>>25))
+static void
+chacha20_block (const uint32_t key[8], uint32_t counter, unsigned char *out)
+{                               // One 64 byte block (RFC8439), zero nonce
+   uint32_t in[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 },
+      x[16];
+   memcpy (in + 4, key, 32);
+   in[12] = counter;
+   memcpy (x, in, sizeof (x));
+   int i;
+   for (i = 0; i < 10; i++)
+   {
+      QR (x[0], x[4], x[8], x[12]);
+      QR (x[1], x[5], x[9], x[13]);
+      QR (x[2], x[6], x[10], x[14]);
+      QR (x[3], x[7], x[11], x[15]);
+      QR (x[0], x[5], x[10], x[15]);
+      QR (x[1], x[6], x[11], x[12]);
+      QR (x[2], x[7], x[8], x[13]);
+      QR (x[3], x[4], x[9], x[14]);
+   }
+   for (i = 0; i < 16; i++)
+   {
+      uint32_t v = x[i] + in[i];
+      out[i * 4 + 0] = v;
+      out[i * 4 + 1] = v >> 8;
+      out[i * 4 + 2] = v >> 16;
+      out[i * 4 + 3] = v >> 24;
+   }
+}
+#undef	QR
+
+static const char *
+rng_get (unsigned char *p, size_t len)
+{                               // Random bytes from this thread's buffer, getrandom only to seed, returns error
+   unsigned int gen = rnggen;
+   if (!rng.seeded || rng.gen != gen)
+   {                            // Seed (or reseed after fork)
+      pthread_once (&rngonce, rng_atfork);
+      size_t got = 0;
+      while (got < sizeof (rng.key))
+      {
+         ssize_t l = getrandom ((unsigned char *) rng.key + got, sizeof (rng.key) - got, 0);
+         if (l < 0 && errno != EINTR)
+            return "Random failed";
+         if (l > 0)
+            got += l;
+      }
+      rng.gen = gen;
+      rng.seeded = 1;
+      rng.pos = sizeof (rng.buf);
+   }
+   while (len)
+   {
+      if (rng.pos == sizeof (rng.buf))
+      {                         // Next batch, first 32 bytes become the new key
+         int b;
+         for (b = 0; b < RNGBLOCKS; b++)
+            chacha20_block (rng.key, b, rng.buf + b * 64);
+         memcpy (rng.key, rng.buf, sizeof (rng.key));
+         rng.pos = sizeof (rng.key);
+      }
+      size_t l = sizeof (rng.buf) - rng.pos;
+      if (l > len)
+         l = len;
+      memcpy (p, rng.buf + rng.pos, l);
+      memset (rng.buf + rng.pos, 0, l); // Not kept once used
+      rng.pos += l;
+      p += l;
+      len -= l;
+   }
+   return NULL;
+}
+
+static const char *
+websocket_session (char *s)
+{                               // Make a session id, 64 base32 characters (320 bits) and a NULL, returns error
+   unsigned char r[40];
+   const char *e = rng_get (r, sizeof (r));
+   if (e)
+      return e;
+   unsigned int i,
+     o = 0;
+   for (i = 0; i < sizeof (r); i += 5)
+   {
+      uint64_t v = ((uint64_t) r[i] << 32) | ((uint64_t) r[i + 1] << 24) | (r[i + 2] << 16) | (r[i + 3] << 8) | r[i + 4];
+      int b;
+      for (b = 35; b >= 0; b -= 5)
+      {                         // A-Z then 2-7, without a branch or table
+         int c = (v >> b) & 31;
+         s[o++] = 'A' + c - (((25 - c) >> 8) & ('A' + 26 - '2'));
+      }
+   }
+   s[o] = 0;
+   memset (r, 0, sizeof (r));
+   return NULL;
+}
+
+static int
+req_is (const char *ref, const unsigned char *v, unsigned int len)
+{                               // Span is exactly this
+   return v && strlen (ref) == len && !memcmp (ref, v, len);
+}
+
+typedef struct route_s route_t;
+struct route_s
+{                               // Bound paths at one place in the router, by origin
+   websocket_path_t *any;       // No origin check
+   websocket_path_t **origin;   // Open addressed on origin hash
+   unsigned int size,           // Slots (power of 2)
+     n;
+};
+
+typedef struct rnode_s rnode_t;
+struct rnode_s
+{                               // Router path trie, a node per path segment
+   const char *seg;             // Segment (in the bound path)
+   unsigned int seglen;
+   unsigned int n;              // Children
+   rnode_t **child;             // Sorted by segment
+   rnode_t *star;               // * segment, any one segment
+   route_t end;                 // Path ends here
+   route_t rest;                // ** at end, here and anything under it
+};
+
+typedef struct rhost_s rhost_t;
+struct rhost_s
+{                               // Router for one host
+   const char *host;            // NULL for any host
+   unsigned int hash;
+   rnode_t root;
+   route_t any;                 // No path check
+};
+
+struct websocket_router_s
+{                               // Routing for a bind, made when paths change and then not changed, so used without a lock
+   websocket_router_t *next;    // Retired
+   unsigned int gen;            // pathgen made for
+   unsigned int size;           // Host slots (power of 2)
+   rhost_t **host;              // Open addressed on host hash
+   rhost_t any;                 // Any host
+};
+
+static const char *
+route_add (route_t * r, websocket_path_t * p)
+{                               // Add a path, paths are added newest first and the newest wins, returns error
+   if (!p->origin)
+   {
+      if (!r->any)
+         r->any = p;
+      return NULL;
+   }
+   if ((r->n + 1) * 2 > r->size)
+   {                            // Grow
+      websocket_path_t **old = r->origin,
+         **origin = calloc (r->size ? r->size * 2 : 4, sizeof (*origin));
+      if (!origin)
+         return "Malloc fail";
+      unsigned int size = r->size,
+         i;
+      r->size = (size ? size * 2 : 4);
+      r->origin = origin;
+      r->n = 0;
+      for (i = 0; i < size; i++)
+         if (old[i])
+            route_add (r, old[i]);      // Never needs to grow
+      free (old);
+   }
+   unsigned int i = str_hash (p->origin);
+   websocket_path_t *q;
+   for (; (q = r->origin[i & (r->size - 1)]); i++)
+      if (!strcmp (q->origin, p->origin))
+         return NULL;           // Newer already here
+   r->origin[i & (r->size - 1)] = p;
+   r->n++;
+   return NULL;
+}
+
+static websocket_path_t *
+route_get (route_t * r, const unsigned char *origin, unsigned int len)
+{                               // Bound path for this origin, or for any origin, NULL if none
+   if (origin && r->n)
+   {
+      unsigned int i = mem_hash (origin, len);
+      websocket_path_t *p;
+      while ((p = r->origin[i & (r->size - 1)]) && !req_is (p->origin, origin, len))
+         i++;
+      if (p)
+         return p;
+   }
+   return r->any;
+}
+
+static int
+rnode_cmp (rnode_t * n, const unsigned char *seg, unsigned int len)
+{
+   if (n->seglen != len)
+      return n->seglen < len ? -1 : 1;
+   return memcmp (n->seg, seg, len);
+}
+
+static rnode_t *
+rnode_child (rnode_t * n, const unsigned char *seg, unsigned int len, int make)
+{                               // Find (or make) the child for a segment, NULL if none (or cannot make)
+   unsigned int lo = 0,
+      hi = n->n;
+   while (lo < hi)
+   {                            // Binary chop
+      unsigned int m = (lo + hi) / 2;
+      int c = rnode_cmp (n->child[m], seg, len);
+      if (!c)
+         return n->child[m];
+      if (c < 0)
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   if (!make)
+      return NULL;
+   rnode_t *c = calloc (1, sizeof (*c)),
+      **child = realloc (n->child, (n->n + 1) * sizeof (*n->child));
+   if (child)
+      n->child = child;
+   if (!c || !child)
+   {
+      free (c);
+      return NULL;
+   }
+   c->seg = (const char *) seg;
+   c->seglen = len;
+   memmove (n->child + lo + 1, n->child + lo, (n->n - lo) * sizeof (*n->child));
+   n->child[lo] = c;
+   n->n++;
+   return c;
+}
+
+static websocket_path_t *
+rnode_find (rnode_t * n, const unsigned char *p, const unsigned char *e, int more, const unsigned char *origin,
+            unsigned int originlen)
+{                               // Match path segments p to e (if more), exact segments first, then *, then **
+   websocket_path_t *r;
+   if (!more)
+   {
+      if ((r = route_get (&n->end, origin, originlen)))
+         return r;
+   } else
+   {
+      const unsigned char *s = memchr (p, '/', e - p);
+      rnode_t *c = rnode_child (n, p, (s ? : e) - p, 0);
+      if (c && (r = rnode_find (c, s ? s + 1 : e, e, s ? 1 : 0, origin, originlen)))
+         return r;
+      if (n->star && (r = rnode_find (n->star, s ? s + 1 : e, e, s ? 1 : 0, origin, originlen)))
+         return r;
+   }
+   return route_get (&n->rest, origin, originlen);
+}
+
+static void
+rnode_free (rnode_t * n)
+{                               // Free what a node has (not the node itself)
+   unsigned int i;
+   for (i = 0; i < n->n; i++)
+   {
+      rnode_free (n->child[i]);
+      free (n->child[i]);
+   }
+   free (n->child);
+   if (n->star)
+   {
+      rnode_free (n->star);
+      free (n->star);
+   }
+   free (n->end.origin);
+   free (n->rest.origin);
+}
+
+static void
+router_free (websocket_router_t * rt)
+{
+   unsigned int i;
+   for (i = 0; rt->host && i < rt->size; i++)
+      if (rt->host[i])
+      {
+         rnode_free (&rt->host[i]->root);
+         free (rt->host[i]->any.origin);
+         free (rt->host[i]);
+      }
+   free (rt->host);
+   rnode_free (&rt->any.root);
+   free (rt->any.any.origin);
+   free (rt);
+}
+
+static const char *
+router_add (websocket_router_t * rt, websocket_path_t * p)
+{                               // Add a path, returns error
+   rhost_t *h = &rt->any;
+   if (p->host)
+   {
+      unsigned int i = str_hash (p->host);
+      while ((h = rt->host[i & (rt->size - 1)]) && strcmp (h->host, p->host))
+         i++;
+      if (!h)
+      {
+         if (!(h = calloc (1, sizeof (*h))))
+            return "Malloc fail";
+         rt->host[i & (rt->size - 1)] = h;
+         h->host = p->host;
+         h->hash = str_hash (p->host);
+      }
+   }
+   if (!p->path)
+      return route_add (&h->any, p);
+   rnode_t *n = &h->root;
+   const unsigned char *s = (const unsigned char *) p->path,
+      *e = s + strlen (p->path);
+   while (1)
+   {
+      const unsigned char *x = memchr (s, '/', e - s) ? : e;
+      if (x == e && x - s == 2 && !memcmp (s, "**", 2))
+         return route_add (&n->rest, p);
+      if (x - s == 1 && *s == '*')
+      {
+         if (!n->star && !(n->star = calloc (1, sizeof (*n->star))))
+            return "Malloc fail";
+         n = n->star;
+      } else if (!(n = rnode_child (n, s, x - s, 1)))
+         return "Malloc fail";
+      if (x == e)
+         break;
+      s = x + 1;
+   }
+   return route_add (&n->end, p);
+}
+
+static websocket_router_t *
+router_make (websocket_bind_t * b)
+{                               // New router for the bind's paths (bind locked), NULL if cannot
+   websocket_router_t *rt = calloc (1, sizeof (*rt));
+   if (!rt)
+      return NULL;
+   rt->gen = atomic_load_explicit (&b->pathgen, memory_order_relaxed);
+   websocket_path_t *p;
+   for (p = b->paths; p; p = p->next)
+      if (p->host)
+         rt->size++;
+   if (rt->size)
+   {                            // Hosts at most half full
+      unsigned int size = 4;
+      while (size < rt->size * 2)
+         size *= 2;
+      rt->size = size;
+      if (!(rt->host = calloc (size, sizeof (*rt->host))))
+      {
+         free (rt);
+         return NULL;
+      }
+   }
+   for (p = b->paths; p; p = p->next)
+      if (router_add (rt, p))
+      {
+         router_free (rt);
+         return NULL;
+      }
+   return rt;
+}
+
+static websocket_path_t *
+router_path (websocket_router_t * rt, const unsigned char *host, unsigned int hostlen, const unsigned char *origin,
+             unsigned int originlen, const unsigned char *url, unsigned int urllen)
+{                               // Bound path for a request, most specific host, then path, then origin, NULL if none
+   websocket_path_t *p;
+   rhost_t *h = NULL;
+   if (host && rt->size)
+   {
+      unsigned int hash = mem_hash (host, hostlen),
+         i = hash;
+      while ((h = rt->host[i & (rt->size - 1)]) && (h->hash != hash || !req_is (h->host, host, hostlen)))
+         i++;
+   }
+   if (h && ((p = rnode_find (&h->root, url, url + urllen, 1, origin, originlen)) || (p = route_get (&h->any, origin, originlen))))
+      return p;
+   h = &rt->any;
+   if ((p = rnode_find (&h->root, url, url + urllen, 1, origin, originlen)))
+      return p;
+   return route_get (&h->any, origin, originlen);
+}
+
+static const char *
+router_find (websocket_bind_t * b, const unsigned char *host, unsigned int hostlen, const unsigned char *origin,
+             unsigned int originlen, const unsigned char *url, unsigned int urllen, websocket_path_t ** pathp)
+{                               // Bound path for a request (NULL if none), returns error
+   // Sequentially consistent, so once the count is seen as 0 after a router is retired, a new request gets a newer one
+   atomic_fetch_add (&b->routing, 1);
+   websocket_router_t *rt = atomic_load (&b->router);
+   if (!rt || rt->gen != atomic_load_explicit (&b->pathgen, memory_order_acquire))
+   {                            // Paths changed, make a new router
+      pthread_mutex_lock (&b->mutex);
+      rt = atomic_load (&b->router);
+      websocket_router_t *n;
+      if ((!rt || rt->gen != atomic_load_explicit (&b->pathgen, memory_order_relaxed)) && (n = router_make (b)))
+      {                         // Else stay with the old one, and try again next time
+         if (rt)
+         {                      // Retired, as a request may still be using it
+            rt->next = atomic_load (&b->retired);
+            atomic_store (&b->retired, rt);
+         }
+         atomic_store (&b->router, rt = n);
+      }
+      pthread_mutex_unlock (&b->mutex);
+   }
+   *pathp = (rt ? router_path (rt, host, hostlen, origin, originlen, url, urllen) : NULL);
+   if (atomic_fetch_sub (&b->routing, 1) == 1 && atomic_load (&b->retired))
+   {                            // Last out, free retired routers if still no request is routing
+      websocket_router_t *old = NULL;
+      pthread_mutex_lock (&b->mutex);
+      if (!atomic_load (&b->routing))
+         old = atomic_exchange (&b->retired, NULL);
+      pthread_mutex_unlock (&b->mutex);
+      while (old)
+      {
+         websocket_router_t *next = old->next;
+         router_free (old);
+         old = next;
+      }
+   }
+   return rt ? NULL : "Malloc fail";
+}
+
+typedef struct req_s req_t;
+struct req_s
+{                               // Request line and headers as offsets and lengths in rxdata, found without changing or allocating anything
+   unsigned int method,
+     methodlen;
+   unsigned int url,            // Path, without any query
+     urllen;
+   unsigned int query,          // After the ?, 0 length if none
+     querylen;
+   int n;                       // Headers
+   struct
+   {
+      unsigned int name,
+        value,
+        valuelen;
+      unsigned short namelen;
+   } h[HEADERS];
+};
+
+static const char *
+req_parse (req_t * r, const unsigned char *d, size_t len)
+{                               // Find the spans of a request, len is up to the blank line at the end of the headers, returns error
+   const unsigned char *e = d + len,
+      *p = d,
+      *l;
+   while (p < e && isalpha (*p))
+      p++;
+   if (p == d || p >= e || *p != ' ')
+      return "Bad request";
+   r->method = 0;
+   r->methodlen = p - d;
+   while (p < e && *p == ' ')
+      p++;
+   if (!(l = memchr (p, '\n', e - p)))
+      return "Bad request";
+   const unsigned char *u = p;
+   while (p < l && *p > ' ')
+      p++;
+   if (p == u)
+      return "Bad request";
+   const unsigned char *q = memchr (u, '?', p - u);
+   r->url = u - d;
+   r->urllen = (q ? : p) - u;
+   r->query = (q ? q + 1 - d : 0);
+   r->querylen = (q ? p - q - 1 : 0);
+   r->n = 0;
+   for (p = l + 1; p < e;)
+   {                            // Headers, memchr to find each line end is SIMD in libc
+      const unsigned char *s = p;
+      while ((l = memchr (p, '\n', e - p)) && l + 1 < e && (l[1] == ' ' || l[1] == '\t'))
+         p = l + 1;             // Continuation line
+      if (!l)
+         l = e;
+      p = l + 1;
+      if (l > s && l[-1] == '\r')
+         l--;
+      if (l == s)
+         break;                 // Blank line
+      const unsigned char *c = s;
+      while (c < l && (isalnum (*c) || *c == '-'))
+         c++;
+      const unsigned char *n = c;
+      while (c < l && *c == ' ')
+         c++;
+      if (n == s || c == l || *c != ':')
+         continue;              // Not a header, ignored
+      for (c++; c < l && (*c == ' ' || *c == '\t'); c++);
+      while (l > c && (l[-1] == ' ' || l[-1] == '\t'))
+         l--;
+      if (r->n == HEADERS)
+         return "431 Too many headers";
+      r->h[r->n].name = s - d;
+      r->h[r->n].namelen = n - s;
+      r->h[r->n].value = c - d;
+      r->h[r->n].valuelen = l - c;
+      r->n++;
+   }
+   return NULL;
+}
+
+static const unsigned char *
+req_get (req_t * r, const unsigned char *d, const char *name, unsigned int *len)
+{                               // The last header of a name (any case), NULL if none, does not end with a NULL
+   size_t l = strlen (name);
+   int i;
+   for (i = r->n; i--;)
+      if (r->h[i].namelen == l && !strncasecmp ((char *) d + r->h[i].name, name, l))
+      {
+         *len = r->h[i].valuelen;
+         return d + r->h[i].value;
+      }
+   return NULL;
+}
+
+static void
+req_terminate (req_t * r, unsigned char *d)
+{                               // NULL terminate the spans in rxdata, and make method and header names lower case, only done once
+   unsigned int i;
+   for (i = 0; i < r->methodlen; i++)
+      d[i] = tolower (d[i]);
+   d[r->methodlen] = 0;
+   d[r->url + r->urllen] = 0;
+   if (r->querylen)
+      d[r->query + r->querylen] = 0;
+   int h;
+   for (h = 0; h < r->n; h++)
+   {
+      unsigned char *n = d + r->h[h].name;
+      for (i = 0; i < r->h[h].namelen; i++)
+         n[i] = tolower (n[i]);
+      n[i] = 0;
+      d[r->h[h].value + r->h[h].valuelen] = 0;
+   }
+}
+
+static const char *
+websocket_route (websocket_t * w, req_t * r, websocket_path_t ** pathp)
+{                               // Bound path for the request in rxdata (NULL if none), returns error
+   const unsigned char *d = w->rxdata,
+      *host,
+      *origin;
+   unsigned int hostlen = 0,
+      originlen = 0;
+   host = req_get (r, d, "host", &hostlen);
+   origin = req_get (r, d, "origin", &originlen);
+   return router_find (w->bind, host, hostlen, origin, originlen, d + r->url, r->urllen, pathp);
+}
+
+static int
+websocket_request (websocket_t * w, const char **errp)
+{                               // Check if rxdata has a whole request (headers and any body), 1 if complete, -1 if failed (error set)
+   if (!w->rxep)
+   {                            // Look for end of headers
+      size_t ep = w->rxwant;    // Used as scan point until headers found
+      unsigned char *f = (w->rxptr > ep ? memmem (w->rxdata + ep, w->rxptr - ep, "\r\n\r\n", 4) : NULL);
+      if (!f)
+      {
+         w->rxwant = (w->rxptr > 3 ? w->rxptr - 3 : 0);
+         return 0;
+      }
+      w->rxep = f + 4 - w->rxdata;
+      // Work out if there is a body to wait for
+      int post = 0,
+         expect = 0;
+      size_t cl = 0;
+      req_t r;
+      if (!req_parse (&r, w->rxdata, w->rxep))
+      {                         // Bad requests are reported by the handshake
+         const unsigned char *v;
+         unsigned int l;
+         post = (r.methodlen == 4 && !strncasecmp ((char *) w->rxdata, "post", 4));
+         if ((v = req_get (&r, w->rxdata, "content-length", &l)))
+         {                      // Digits only, no sign, and must fit after the headers
+            if (!l)
+               *errp = "400 Bad Content-Length";
+            while (l-- && !*errp)
+               if (!isdigit (*v) || cl > (SIZE_MAX - w->rxep - 1 - (*v - '0')) / 10)
+                  *errp = "400 Bad Content-Length";
+               else
+                  cl = cl * 10 + (*v++ - '0');
+            if (!*errp && cl > BODYMAX)
+               *errp = "413 Content too large";
+            if (*errp)
+               return -1;
+         }
+         if ((v = req_get (&r, w->rxdata, "expect", &l)))
+         {
+            expect = 1;
+            if (l >= 3 && !strncmp ((char *) v, "100", 3))
+            {                   // Only ask for the body if it has somewhere to go, else the handshake refuses it now
+               websocket_path_t *path = NULL;
+               if (websocket_route (w, &r, &path) || !path)
+                  post = expect = cl = 0;
+               else
+                  w->rxcont = 1;        // Sent by the caller
+            }
+         }
+      }
+      if (cl)
+         w->rxwant = w->rxep + cl;
+      else if (post || expect)
+         w->rxwant = SIZE_MAX;  // Until closed
+      else
+         w->rxwant = w->rxep;
+      if (w->rxwant != SIZE_MAX && w->rxlen < w->rxwant + 1)
+      {                         // Space for whole body
+         unsigned char *n = realloc (w->rxdata, w->rxwant + 1);
+         if (!n)
+         {
+            *errp = "Malloc fail";
+            return -1;
+         }
+         w->rxdata = n;
+         w->rxlen = w->rxwant + 1;
+      }
+      if (w->rxwant != SIZE_MAX && w->rxptr >= w->rxwant)
+         w->rxcont = 0;         // Already have the body
+   }
+   if (w->rxwant == SIZE_MAX)
+   {
+      if (w->rxptr - w->rxep > BODYMAX)
+      {
+         *errp = "413 Content too large";
+         return -1;
+      }
+      return w->rxeof;
+   }
+   return w->rxptr >= w->rxwant;
+}
+
+static char *
+websocket_pmd_trim (char *v)
+{                               // Trim spaces (and quotes from a value)
+   while (*v == ' ' || *v == '\t')
+      v++;
+   char *e = v + strlen (v);
+   while (e > v && (e[-1] == ' ' || e[-1] == '\t'))
+      *--e = 0;
+   if (e - v >= 2 && *v == '"' && e[-1] == '"')
+   {
+      e[-1] = 0;
+      v++;
+   }
+   return v;
+}
+
+static int
+websocket_pmd_bits (const char *v)
+{                               // Window bits value, 0 if not valid
+   if (!v || !isdigit (v[0]) || (v[1] && (!isdigit (v[1]) || v[2])))
+      return 0;
+   int n = atoi (v);
+   return (n >= 8 && n <= 15) ? n : 0;
+}
+
+static websocket_pmd_t *
+websocket_pmd_agree (websocket_path_t * path, const unsigned char *v, unsigned int len, char *reply, size_t size)
+{                               // Accept the first permessage-deflate offer we can (RFC7692), sets reply parameters, NULL if none
+   char *s = strndupa ((char *) v, len),
+      *offer;
+   while ((offer = strsep (&s, ",")))
+   {
+      if (strcasecmp (websocket_pmd_trim (strsep (&offer, ";")), "permessage-deflate"))
+         continue;
+      int seen = 0,
+         txbits = path->deflatebits,
+         rxbits = 15,
+         takeover = path->deflatetakeover,
+         cmax = 0;
+      char *param;
+      while ((param = strsep (&offer, ";")))
+      {
+         char *val = strchr (param, '=');
+         if (val)
+            *val++ = 0;
+         param = websocket_pmd_trim (param);
+         if (val)
+            val = websocket_pmd_trim (val);
+         int n = websocket_pmd_bits (val);
+         if (!strcasecmp (param, "server_no_context_takeover") && !val && !(seen & 1))
+         {
+            seen |= 1;
+            takeover = 0;
+         } else if (!strcasecmp (param, "client_no_context_takeover") && !val && !(seen & 2))
+            seen |= 2;          // Far end starting afresh each message is no matter to us
+         else if (!strcasecmp (param, "server_max_window_bits") && n && !(seen & 4))
+         {
+            seen |= 4;
+            if (n < txbits)
+               txbits = n;
+         } else if (!strcasecmp (param, "client_max_window_bits") && (!val || n) && !(seen & 8))
+         {
+            seen |= 8;
+            cmax = (val ? n : 15);
+         } else
+            break;              // Unknown, repeated or bad, so not this offer
+      }
+      if (param || txbits < 9)
+         continue;              // zlib cannot compress with a window of 8
+      if (cmax && path->deflatebits < 15)
+         rxbits = (cmax < path->deflatebits ? cmax : path->deflatebits);        // Far end can use a smaller window
+      websocket_pmd_t *z = calloc (1, sizeof (*z));
+      if (!z)
+         return NULL;
+      z->txbits = txbits;
+      z->rxbits = rxbits;
+      z->takeover = takeover;
+      int l = snprintf (reply, size, "permessage-deflate");
+      if (!takeover)
+         l += snprintf (reply + l, size - l, "; server_no_context_takeover");
+      if ((seen & 4) || txbits < 15)
+         l += snprintf (reply + l, size - l, "; server_max_window_bits=%d", txbits);
+      if (rxbits < 15)
+         l += snprintf (reply + l, size - l, "; client_max_window_bits=%d", rxbits);
+      return z;
+   }
+   return NULL;
+}
+
+static char *
+websocket_handshake (websocket_t * w)
+{                               // Process request in rxdata, either http or websocket connect
+   unsigned int ep = w->rxep;
+   if (websocket_debug)
+      fprintf (stderr, "Rx handshake [%.*s]\n", (int) ep - 4, w->rxdata);
+   // Find the request line and headers, nothing is changed or allocated until we know where it is going
+   req_t r;
+   const char *fail = req_parse (&r, w->rxdata, ep);
+   if (fail)
+      return (char *) fail;
+   unsigned char *d = w->rxdata;
+   unsigned int hostlen = 0;
+   const unsigned char *host = req_get (&r, d, "host", &hostlen);
+   websocket_path_t *path = NULL;
+   {
+      const char *e = websocket_route (w, &r, &path);
+      if (e)
+         return (char *) e;
+   }
+   if (!path)
+      return "Path not found";
+   w->path = path;
+   websocket_set_txlimit (w, path->txmaxbytes, path->txmaxmsgs, path->txpolicy);
+   char *session = NULL;
+   {                            // Scan for our session cookie
+      int l = strlen (wscookie),
+         h;
+      for (h = 0; h < r.n && !session; h++)
+         if (r.h[h].namelen == 6 && !strncasecmp ((char *) d + r.h[h].name, "cookie", 6))
+         {
+            const char *data = (char *) d + r.h[h].value,
+               *end = data + r.h[h].valuelen;
+            while (data < end)
+            {
+               while (data < end && isspace (*data))
+                  data++;
+               if (end - data > l && !strncmp (data, wscookie, l) && !isalnum (data[l]))
+               {                // Looks like our cookie
+                  data += l;
+                  while (data < end && isspace (*data))
+                     data++;
+                  if (data < end && *data == '=')
+                  {
+                     data++;
+                     while (data < end && isspace (*data))
+                        data++;
+                     const char *e = data;
+                     while (e < end && *e != ';')
+                        e++;
+                     while (e > data && isspace (e[-1]))
+                        e--;
+                     session = malloc (e + 1 - data);
+                     if (!session)
+                        return "Malloc fail";
+                     memcpy (session, data, e - data);
+                     session[e - data] = 0;
+                  }
+                  break;
+               }
+               while (data < end && *data != ';')
+                  data++;
+               if (data < end)
+                  data++;
+            }
+         }
+   }
+   if (!session)
+   {                            // Make a session id
+      session = malloc (65);
+      if (!session)
+         return "Malloc fail";
+      const char *e = websocket_session (session);
+      if (e)
+      {
+         free (session);
+         return (char *) e;
+      }
+   }
+#ifdef	USEAXL
+   xml_t xhead = NULL;
+#endif
+#ifdef	USEAJL
+   j_t jhead = NULL;
+#endif
+   int made = 0;
+   void head (void)
+   {                            // Make the head object for the callback, only when one is actually called
+      if (made++)
+         return;
+      req_terminate (&r, d);
+#ifdef	USEAXL
+      xhead = xml_tree_new ((char *) d);
+#endif
+#ifdef	USEAJL
+      jhead = j_create ();
+      j_store_string (jhead, "method", (char *) d);
+#endif
+      char *query = (r.querylen ? (char *) d + r.query : NULL);
+      if (query)
+      {                         // decode query args and add to header too
+#ifdef	USEAXL
+         xml_t xq = xhead;
+         xq = xml_add (xhead, "query", query);  // New format creates query as sub object of head
+#endif
+#ifdef	USEAJL
+         j_t jq = j_store_object (jhead, "query");
+#endif
+         while (*query)
+         {                      // URL decode
+            char *p = query,
+               *v = NULL;
+            while (*p && *p != '=' && *p != '&')
                p++;
             if (*p == '=')
             {
@@ -584,841 +2989,2556 @@ websocket_do_rx (websocket_t * w)
                if (o < p)
                   *o = 0;
             }
-            if (*p == '&')
-               *p++ = 0;
+            if (*p == '&')
+               *p++ = 0;
+#ifdef	USEAXL
+            xml_attribute_t a = xml_attribute_set (xq, query, v ? : "null");
+            if (a && !v)
+               a->json_unquoted = 1;
+#endif
+#ifdef	USEAJL
+            j_store_string (jq, query, v);
+#endif
+            query = p;
+         }
+      }
+#ifdef	USEAXL
+      xml_t xhttp = xhead;
+      xhttp = xml_element_add (xhead, "http");  // Sub object if using raw logic
+      xml_element_set_content (xhttp, (char *) d + r.url);      // The URL
+#endif
+#ifdef	USEAJL
+      j_t jhttp = j_store_object (jhead, "http");
+      j_store_string (jhttp, "url", (char *) d + r.url);
+#endif
+      int h;
+      for (h = 0; h < r.n; h++)
+      {
+         char *n = (char *) d + r.h[h].name,
+            *v = (char *) d + r.h[h].value;
+         if (!strcmp (n, "authorization") && !strncasecmp (v, "Basic ", 6))
+         {
+            v += 6;
+            while (*v == ' ')
+               v++;
+            unsigned char *data = NULL;
+#ifdef	USEAXL
+            {
+               int l = xml_base64d (v, &data);
+               if (data)
+               {
+                  data = realloc (data, l + 1);
+                  data[l] = 0;
+                  xml_attribute_set (xhttp, n, (char *) data);
+                  free (data);
+               }
+            }
+#endif
+#ifdef	USEAJL
+            {
+               int l = j_base64d (v, &data);
+               if (data)
+               {
+                  j_store_stringn (jhttp, n, (char *) data, l);
+                  free (data);
+               }
+            }
+#endif
+         } else
+         {
+#ifdef	USEAXL
+            xml_attribute_set (xhttp, n, v);
+#endif
+#ifdef	USEAJL
+            j_store_string (jhttp, n, v);
+#endif
+         }
+      }
+#ifdef	USEAXL
+      xml_add (xhead, "@session", session);
+      xml_attribute_set (xhead, "IP", w->from);
+#endif
+#ifdef	USEAJL
+      j_store_string (jhead, "session", session);
+      j_store_string (jhead, "IP", w->from);
+#endif
+   }
+   char *er = NULL;
+   unsigned int vlen = 0;
+   const unsigned char *v = req_get (&r, d, "upgrade", &vlen);
+   if (!v)
+   {                            // HTTP, callback here even with workers as it makes the response
+      unsigned int l;
+      if ((r.methodlen == 4 && !strncasecmp ((char *) d, "post", 4)) || req_get (&r, d, "expect", &l)
+          || req_get (&r, d, "content-length", &l))
+      {                         // data received with request
+         head ();               // Before the body replaces the headers
+         size_t max = w->rxptr;
+         if (max > w->rxwant)
+            max = w->rxwant;    // Ignore anything after the body
+         memmove (w->rxdata, w->rxdata + ep, max - ep);
+         w->rxptr = max - ep;
+         w->rxdata[w->rxptr] = 0;
+         if (websocket_debug)
+            fprintf (stderr, "Parse [%s]\n", (char *) w->rxdata);
+#ifdef	USEAXL
+         if (w->path && w->path->callbackxmlraw)
+         {                      // Raw data callback
+            if (websocket_debug)
+               fprintf (stderr, "%p Post callback\n", w);
+            er = w->path->callbackxmlraw (NULL, xhead, w->rxptr, w->rxdata);
+            xhead = NULL;       // assumed to consume head/data
+            w->rxdata = NULL;   // consumed
+            w->rxptr = 0;
+         } else if (w->path && w->path->callbackxml)
+         {                      // Note can call a post with null if nothing posted
+            xml_t data = xml_tree_parse_json ((char *) w->rxdata, "json");
+            if (websocket_debug)
+               fprintf (stderr, "%p Post callback\n", w);
+            er = w->path->callbackxml (NULL, xhead, data);
+            xhead = NULL;       // assumed to consume head/data
+         }
+#endif
+#ifdef	USEAJL
+         if (w->path && w->path->callbackjsonraw)
+         {                      // Raw data callback
+            if (websocket_debug)
+               fprintf (stderr, "%p Post callback\n", w);
+            er = w->path->callbackjsonraw (NULL, jhead, w->rxptr, w->rxdata);
+            jhead = NULL;       // assumed consumed
+            w->rxdata = NULL;   // consumed
+            w->rxptr = 0;
+         } else if (w->path && w->path->callbackjson)
+         {                      // Note can call a post with null if nothing posted
+            j_t data = j_create ();
+            if (j_read_mem (data, (char *) w->rxdata, w->rxptr))
+               j_delete (&data);
+            if (websocket_debug)
+               fprintf (stderr, "%p Post callback\n", w);
+            er = w->path->callbackjson (NULL, jhead, data);
+            jhead = NULL;       // assumed consumed
+         }
+#endif
+      } else
+      {
+#ifdef	USEAXL
+         if (w->path && w->path->callbackxmlraw)
+         {
+            if (websocket_debug)
+               fprintf (stderr, "%p Get callback\n", w);
+            head ();
+            er = w->path->callbackxmlraw (NULL, xhead, 0, NULL);
+            xhead = NULL;
+         } else if (w->path && w->path->callbackxml)
+         {
+            if (websocket_debug)
+               fprintf (stderr, "%p Get callback\n", w);
+            head ();
+            er = w->path->callbackxml (NULL, xhead, NULL);
+            xhead = NULL;
+         }
+#endif
+#ifdef	USEAJL
+         if (w->path && w->path->callbackjsonraw)
+         {
+            if (websocket_debug)
+               fprintf (stderr, "%p Get callback\n", w);
+            head ();
+            er = w->path->callbackjsonraw (NULL, jhead, 0, NULL);
+            jhead = NULL;       // assumed consumed
+         } else if (w->path && w->path->callbackjson)
+         {
+            if (websocket_debug)
+               fprintf (stderr, "%p Get callback\n", w);
+            head ();
+            er = w->path->callbackjson (NULL, jhead, NULL);
+            jhead = NULL;       // assumed consumed
+         }
+#endif
+      }
+      if (!er)
+         er = "204 No content";
+   } else
+   {                            // Web socket
+      char *hostname = strndupa ((char *) host ? : "", hostlen);
+      {                         // Strip port
+         char *p = strrchr (hostname, ':');
+         if (p)
+            *p = 0;
+      }
+      char *url = strndupa ((char *) d + r.url, r.urllen);
+      unsigned char hash[SHA_DIGEST_LENGTH] = { };
+      if (r.methodlen != 3 || strncasecmp ((char *) d, "get", 3))
+         er = "Bad request (not GET)";
+      if (vlen != 9 || strncasecmp ((char *) v, "websocket", 9))
+         er = "Bad upgrade header (not websocket)";
+      if (!(v = req_get (&r, d, "sec-websocket-version", &vlen)))
+         er = "No version";
+      else if (atoi (strndupa ((char *) v, vlen)) != 13)
+         er = "Bad version (not 13)";
+      if (!(v = req_get (&r, d, "sec-websocket-key", &vlen)))
+         er = "No websocket key";
+      else
+      {
+         SHA_CTX c;
+         SHA1_Init (&c);
+         SHA1_Update (&c, v, vlen);
+         SHA1_Update (&c, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
+         SHA1_Final (hash, &c);
+      }
+      char pmd[128] = "";
+      if (!er && path->deflate && (v = req_get (&r, d, "sec-websocket-extensions", &vlen)))
+         w->pmd = websocket_pmd_agree (path, v, vlen, pmd, sizeof (pmd));       // Compression
+      // Connect callback here even with workers, as its response decides the handshake
+#ifdef	USEAXL
+      if (!er && w->path->callbackxmlraw)
+      {
+         if (websocket_debug)
+            fprintf (stderr, "%p Connect callback\n", w);
+         head ();
+         er = w->path->callbackxmlraw (w, xhead, 0, NULL);
+         xhead = NULL;
+      } else if (!er && w->path->callbackxml)
+      {
+         if (websocket_debug)
+            fprintf (stderr, "%p Connect callback\n", w);
+         head ();
+         er = w->path->callbackxml (w, xhead, NULL);
+         xhead = NULL;
+      }
+#endif
+#ifdef	USEAJL
+      if (!er && w->path->callbackjsonraw)
+      {
+         if (websocket_debug)
+            fprintf (stderr, "%p Connect callback\n", w);
+         head ();
+         er = w->path->callbackjsonraw (w, jhead, 0, NULL);
+         jhead = NULL;          // assumed consumed
+      } else if (!er && w->path->callbackjson)
+      {
+         if (websocket_debug)
+            fprintf (stderr, "%p Connect callback\n", w);
+         head ();
+         er = w->path->callbackjson (w, jhead, NULL);
+         jhead = NULL;          // assumed consumed
+      }
+#endif
+      txb_t *txb = NULL;
+      if (!er && !(txb = pool_alloc (&pools[POOL_TXB])))
+         er = "Malloc fail";
+      if (!er)
+      {                         // Response...
+         atomic_init (&txb->count, 1);
+         txb->len = asprintf ((char **) &txb->buf,      //
+                              "HTTP/1.1 101 Switching Protocols\r\n"    //
+                              "Upgrade: websocket\r\n"  //
+                              "Connection: Upgrade\r\n" //
+                              "Set-Cookie: %s=%s; Path=%s; Domain=%s%s\r\n"     //
+                              "%s%s%s"  // Sec-WebSocket-Extensions
+                              "Sec-WebSocket-Accept: %s\r\n"    //
+                              "\r\n",   //
+                              wscookie, session, path->path ? : url, hostname, w->ss ? "; Secure" : "",
+                              *pmd ? "Sec-WebSocket-Extensions: " : "", pmd, *pmd ? "\r\n" : "",
+#ifdef	USEAXL
+                              xml_base64 (SHA_DIGEST_LENGTH, hash)
+#else
+#ifdef	USEAJL
+                              j_base64 (SHA_DIGEST_LENGTH, hash)
+#else
+                              NULL
+#endif
+#endif
+            );
+         if (txb->len <= 0)
+            er = "Bad asprintf";
+         else
+         {                      // Switch protocols message, sent before anything already queued
+            pthread_mutex_lock (&w->mutex);
+            w->txhs = txb;
+            w->connected = 1;   // Allows tx to start
+            pthread_mutex_unlock (&w->mutex);
+            websocket_kick (w);
+         }
+      }
+   }
+#ifdef	USEAXL
+   if (xhead)
+      xml_tree_delete (xhead);
+#endif
+#ifdef	USEAJL
+   if (jhead)
+      j_delete (&jhead);
+#endif
+   free (session);
+   return er;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target ("avx2")))
+static size_t
+unmask_avx2 (unsigned char *dst, const unsigned char *src, size_t len, uint32_t k4)
+{                               // Unmask 32 bytes at a time, returns bytes done
+   __m256i k = _mm256_set1_epi32 (k4);
+   size_t n = 0;
+   for (; n + 32 <= len; n += 32)
+      _mm256_storeu_si256 ((__m256i *) (dst + n), _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i *) (src + n)), k));
+   return n;
+}
+
+__attribute__((target ("sse2")))
+static size_t
+unmask_sse2 (unsigned char *dst, const unsigned char *src, size_t len, uint32_t k4)
+{                               // Unmask 16 bytes at a time, returns bytes done
+   __m128i k = _mm_set1_epi32 (k4);
+   size_t n = 0;
+   for (; n + 16 <= len; n += 16)
+      _mm_storeu_si128 ((__m128i *) (dst + n), _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (src + n)), k));
+   return n;
+}
+#endif
+
+static size_t
+unmask_words (unsigned char *dst, const unsigned char *src, size_t len, uint32_t k4)
+{                               // Unmask 8 bytes at a time, returns bytes done
+   uint64_t k8 = k4 | ((uint64_t) k4 << 32),
+      v;
+   size_t n = 0;
+   for (; n + 8 <= len; n += 8)
+   {
+      memcpy (&v, src + n, 8);
+      v ^= k8;
+      memcpy (dst + n, &v, 8);
+   }
+   return n;
+}
+
+static int
+websocket_unmask (unsigned char *dst, const unsigned char *src, size_t len, const unsigned char *mask, int q)
+{                               // Unmask (dst can be src) starting at mask phase q, any alignment, returns new phase
+   unsigned char k[4] = { mask[q], mask[(q + 1) & 3], mask[(q + 2) & 3], mask[(q + 3) & 3] };
+   uint32_t k4;
+   memcpy (&k4, k, 4);          // Mask from this phase, whole words keep the phase
+   size_t n = 0;
+#if defined(__x86_64__) || defined(__i386__)
+   if (len >= 64 && __builtin_cpu_supports ("avx2"))
+      n = unmask_avx2 (dst, src, len, k4);
+   else if (len >= 16 && __builtin_cpu_supports ("sse2"))
+      n = unmask_sse2 (dst, src, len, k4);
+#endif
+   n += unmask_words (dst + n, src + n, len - n, k4);   // Whole words so the phase is kept
+   for (; n < len; n++)
+      dst[n] = src[n] ^ k[n & 3];
+   return (q + len) & 3;
+}
+
+enum
+{                               // UTF-8 check error bits, the lookup table method of Keiser and Lemire
+   U8_TOO_SHORT = 1 << 0,       // Lead byte not followed by continuation
+   U8_TOO_LONG = 1 << 1,        // Continuation after ASCII
+   U8_OVERLONG_3 = 1 << 2,
+   U8_TOO_LARGE = 1 << 3,       // Over U+10FFFF
+   U8_SURROGATE = 1 << 4,
+   U8_OVERLONG_2 = 1 << 5,
+   U8_TOO_LARGE_1000 = 1 << 6,
+   U8_OVERLONG_4 = 1 << 6,
+   U8_TWO_CONTS = 1 << 7,       // Continuation after continuation (checked again for 3 and 4 byte sequences)
+   U8_CARRY = U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS,
+};
+
+static const unsigned char utf8_high1[16] = {   // By high nibble of first byte
+   U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+   U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+   U8_TOO_SHORT | U8_OVERLONG_2,
+   U8_TOO_SHORT,
+   U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+   U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4
+};
+
+static const unsigned char utf8_low1[16] = {    // By low nibble of first byte
+   U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+   U8_CARRY | U8_OVERLONG_2,
+   U8_CARRY, U8_CARRY,
+   U8_CARRY | U8_TOO_LARGE,
+   U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+   U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+   U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+   U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+   U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+   U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000, U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000
+};
+
+static const unsigned char utf8_high2[16] = {   // By high nibble of second byte
+   U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+   U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+   U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+   U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+   U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+   U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target ("avx2")))
+static int
+utf8_avx2 (const unsigned char *s, size_t len)
+{                               // Check whole UTF-8 sequences 32 bytes at a time, 0 if valid
+   const __m256i h1 = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) utf8_high1)),
+      l1 = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) utf8_low1)),
+      h2 = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) utf8_high2)),
+      nib = _mm256_set1_epi8 (0x0F),
+      end = _mm256_setr_epi8 (-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,   //
+                              -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1);
+   __m256i prev = _mm256_setzero_si256 (),
+      err = prev,
+      more = prev;
+   unsigned char pad[32];
+   size_t n;
+   for (n = 0; n < len; n += 32)
+   {
+      __m256i in;
+      if (n + 32 <= len)
+         in = _mm256_loadu_si256 ((const __m256i *) (s + n));
+      else
+      {                         // Last part, padded with ASCII
+         memset (pad, 0, sizeof (pad));
+         memcpy (pad, s + n, len - n);
+         in = _mm256_loadu_si256 ((const __m256i *) pad);
+      }
+      if (!_mm256_movemask_epi8 (in))
+      {                         // ASCII, only an unfinished sequence before it is wrong
+         err = _mm256_or_si256 (err, more);
+         more = _mm256_setzero_si256 ();
+         prev = in;
+         continue;
+      }
+      __m256i x = _mm256_permute2x128_si256 (prev, in, 0x21),
+         p1 = _mm256_alignr_epi8 (in, x, 15),
+         p2 = _mm256_alignr_epi8 (in, x, 14),
+         p3 = _mm256_alignr_epi8 (in, x, 13),
+         sc = _mm256_and_si256 (_mm256_and_si256 (_mm256_shuffle_epi8 (h1, _mm256_and_si256 (_mm256_srli_epi16 (p1, 4), nib)),
+                                                  _mm256_shuffle_epi8 (l1, _mm256_and_si256 (p1, nib))),
+                                _mm256_shuffle_epi8 (h2, _mm256_and_si256 (_mm256_srli_epi16 (in, 4), nib))),
+         must = _mm256_or_si256 (_mm256_subs_epu8 (p2, _mm256_set1_epi8 (0xE0 - 0x80)),
+                                 _mm256_subs_epu8 (p3, _mm256_set1_epi8 (0xF0 - 0x80)));
+      err = _mm256_or_si256 (err, _mm256_xor_si256 (_mm256_and_si256 (must, _mm256_set1_epi8 (0x80)), sc));
+      more = _mm256_subs_epu8 (in, end);
+      prev = in;
+   }
+   err = _mm256_or_si256 (err, more);
+   return !_mm256_testz_si256 (err, err);
+}
+
+__attribute__((target ("sse4.1")))
+static int
+utf8_sse4 (const unsigned char *s, size_t len)
+{                               // Check whole UTF-8 sequences 16 bytes at a time, 0 if valid
+   const __m128i h1 = _mm_loadu_si128 ((const __m128i *) utf8_high1),
+      l1 = _mm_loadu_si128 ((const __m128i *) utf8_low1),
+      h2 = _mm_loadu_si128 ((const __m128i *) utf8_high2),
+      nib = _mm_set1_epi8 (0x0F),
+      end = _mm_setr_epi8 (-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1);
+   __m128i prev = _mm_setzero_si128 (),
+      err = prev,
+      more = prev;
+   unsigned char pad[16];
+   size_t n;
+   for (n = 0; n < len; n += 16)
+   {
+      __m128i in;
+      if (n + 16 <= len)
+         in = _mm_loadu_si128 ((const __m128i *) (s + n));
+      else
+      {                         // Last part, padded with ASCII
+         memset (pad, 0, sizeof (pad));
+         memcpy (pad, s + n, len - n);
+         in = _mm_loadu_si128 ((const __m128i *) pad);
+      }
+      if (!_mm_movemask_epi8 (in))
+      {                         // ASCII, only an unfinished sequence before it is wrong
+         err = _mm_or_si128 (err, more);
+         more = _mm_setzero_si128 ();
+         prev = in;
+         continue;
+      }
+      __m128i p1 = _mm_alignr_epi8 (in, prev, 15),
+         p2 = _mm_alignr_epi8 (in, prev, 14),
+         p3 = _mm_alignr_epi8 (in, prev, 13),
+         sc = _mm_and_si128 (_mm_and_si128 (_mm_shuffle_epi8 (h1, _mm_and_si128 (_mm_srli_epi16 (p1, 4), nib)),
+                                            _mm_shuffle_epi8 (l1, _mm_and_si128 (p1, nib))),
+                             _mm_shuffle_epi8 (h2, _mm_and_si128 (_mm_srli_epi16 (in, 4), nib))),
+         must = _mm_or_si128 (_mm_subs_epu8 (p2, _mm_set1_epi8 (0xE0 - 0x80)), _mm_subs_epu8 (p3, _mm_set1_epi8 (0xF0 - 0x80)));
+      err = _mm_or_si128 (err, _mm_xor_si128 (_mm_and_si128 (must, _mm_set1_epi8 (0x80)), sc));
+      more = _mm_subs_epu8 (in, end);
+      prev = in;
+   }
+   err = _mm_or_si128 (err, more);
+   return !_mm_testz_si128 (err, err);
+}
+#endif
+
+static int
+utf8_seqlen (unsigned char c)
+{                               // Length of sequence from lead byte (bad leads are found when checked)
+   return c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+}
+
+static int
+utf8_scalar (const unsigned char *s, size_t len)
+{                               // Check whole UTF-8 sequences a byte at a time (skipping ASCII a word at a time), 0 if valid
+   size_t n = 0;
+   while (n < len)
+   {
+      uint64_t v;
+      if (n + 8 <= len && (memcpy (&v, s + n, 8), !(v & 0x8080808080808080ULL)))
+      {
+         n += 8;
+         continue;
+      }
+      unsigned char c = s[n];
+      if (c < 0x80)
+      {
+         n++;
+         continue;
+      }
+      if (c < 0xC2 || c > 0xF4)
+         return -1;             // Continuation, overlong 2 byte, or too large
+      size_t l = utf8_seqlen (c),
+         i;
+      if (len - n < l)
+         return -1;
+      unsigned int u = (c & (0x7F >> l));
+      for (i = 1; i < l; i++)
+      {
+         if ((s[n + i] & 0xC0) != 0x80)
+            return -1;
+         u = (u << 6) | (s[n + i] & 0x3F);
+      }
+      if ((l == 3 && (u < 0x800 || (u >= 0xD800 && u <= 0xDFFF))) || (l == 4 && (u < 0x10000 || u > 0x10FFFF)))
+         return -1;             // Overlong, surrogate, or too large
+      n += l;
+   }
+   return 0;
+}
+
+static int
+websocket_utf8 (const unsigned char *s, size_t len)
+{                               // Check whole UTF-8 sequences, 0 if valid
+#if defined(__x86_64__) || defined(__i386__)
+   if (len >= 64 && __builtin_cpu_supports ("avx2"))
+      return utf8_avx2 (s, len);
+   if (len >= 16 && __builtin_cpu_supports ("sse4.1"))
+      return utf8_sse4 (s, len);
+#endif
+   return utf8_scalar (s, len);
+}
+
+static int
+websocket_rx_grow (websocket_t * w, size_t len, size_t more)
+{                               // Make rxdata hold len+more and a NULL, doubling so it settles at the largest message, 0 if OK
+   if (more >= SIZE_MAX - len)
+      return -1;                // Would wrap, checked before either buffer test
+   len += more;
+   if (w->path && w->path->callbackrxalloc)
+   {                            // App provides the buffer, exactly what is needed
+      if (w->rxapp && len < w->rxlen)
+         return 0;
+      unsigned char *d = w->path->callbackrxalloc (w, w->rxdata, len + 1);
+      if (!d)
+         return -1;
+      w->rxdata = d;
+      w->rxlen = len + 1;
+      w->rxapp = 1;
+      return 0;
+   }
+   if (len < w->rxlen)
+      return 0;
+   size_t n = (w->rxlen ? : RXMIN);
+   while (n <= len && n <= SIZE_MAX / 2)
+      n *= 2;
+   if (n <= len)
+      n = len + 1;
+   if (w->path && w->path->rxmax && n - 1 > w->path->rxmax)
+      n = w->path->rxmax + 1;   // Never need more than that
+   unsigned char *d = realloc (w->rxdata, n);
+   if (!d)
+      return -1;
+   w->rxdata = d;
+   w->rxlen = n;
+   return 0;
+}
+
+static void
+websocket_rx_idle (websocket_t * w)
+{                               // Free the message buffer if idle long enough (rx side only)
+   if (!w->rxdata || !w->path || !w->path->rxidle || w->rxptr || w->rxhptr || time (0) < w->rxused + w->path->rxidle)
+      return;
+   websocket_rx_free (w, w->rxdata, w->rxapp);
+   w->rxdata = NULL;
+   w->rxlen = 0;
+   w->rxapp = 0;
+}
+
+static int
+websocket_rx_utf8 (websocket_t * w, const unsigned char *p, size_t len, int end)
+{                               // Check part of a text message, a sequence split between parts is held over, 0 if valid so far
+   if (w->rxu8n)
+   {                            // Finish the sequence from the last part
+      size_t l = utf8_seqlen (w->rxu8[0]),
+         need = l - w->rxu8n;
+      if (need > len)
+         need = len;
+      if (need)
+         memcpy (w->rxu8 + w->rxu8n, p, need);
+      w->rxu8n += need;
+      p += need;
+      len -= need;
+      if (w->rxu8n < l)
+         return end ? -1 : 0;
+      w->rxu8n = 0;
+      if (websocket_utf8 (w->rxu8, l))
+         return -1;
+   }
+   size_t t = 0;
+   if (!end)
+   {                            // Hold over an unfinished sequence at the end
+      size_t i;
+      for (i = 1; i <= 3 && i <= len; i++)
+      {
+         unsigned char c = p[len - i];
+         if ((c & 0xC0) == 0x80)
+            continue;
+         if (c >= 0xC0 && (size_t) utf8_seqlen (c) > i)
+            t = i;
+         break;
+      }
+   }
+   if (websocket_utf8 (p, len - t))
+      return -1;
+   if (t)
+      memcpy (w->rxu8, p + len - t, t);
+   w->rxu8n = t;
+   return 0;
+}
+
+static char *
+websocket_rx_control (websocket_t * w)
+{                               // Process a received control frame, payload in rxctl, returns error or "Closed" to end
+   unsigned char *head = w->rxhead;
+   if (websocket_debug)
+   {
+      unsigned int p;
+      fprintf (stderr, "Rx");
+      for (p = 0; p < w->rxctlen; p++)
+         fprintf (stderr, " %02X", w->rxctl[p]);
+      fprintf (stderr, "\n");
+   }
+   if ((head[0] & 0xF) == 8)
+   {                            // Close
+      return "Closed";
+   } else if ((head[0] & 0xF) == 9)
+   {                            // Ping
+      txb_t *txb = pool_alloc (&pools[POOL_TXB]);
+      if (!txb)
+         return "Malloc fail";
+      atomic_init (&txb->count, 1);
+      txb->len = w->rxctlen;
+      txb->buf = malloc (w->rxctlen + 1);
+      if (!txb->buf)
+      {
+         txb_done (txb);
+         return "Malloc fail";
+      }
+      memcpy (txb->buf, w->rxctl, w->rxctlen);
+      txb->head[0] = 0x8A;      // Send Pong
+      txb->head[1] = w->rxctlen;        // Reply is not masked
+      txb->hlen = 2;
+      txb_control (w, txb);     // Not sending a pong if cannot is harmless
+      txb_done (txb);
+   } else if ((head[0] & 0xF) == 0xA)
+   {                            // Pong
+      struct timeval tv;
+      struct timezone tz;
+      gettimeofday (&tv, &tz);
+      unsigned long long pong = tv.tv_sec * 1000000ULL + tv.tv_usec;;
+      unsigned long long ping = 0;
+      if (w->rxctlen == sizeof (ping))
+      {
+         memcpy (&ping, w->rxctl, sizeof (ping));
+         w->ping = pong - ping;
+         if (websocket_debug)
+            fprintf (stderr, "Pong %lluus\n", pong - ping);
+      }
+   }
+   return NULL;
+}
+
+static char *
+websocket_rx_deliver (websocket_t * w, websocket_job_t * j)
+{                               // Callback here or by a worker, returns error
+   if (w->bind->workers)
+   {
+      int full = websocket_work (w, j);
+      if (full < 0)
+      {
+         websocket_job_free (w, j);
+         return "Malloc fail";
+      }
+      if (full)
+         w->throttled = 1;      // Event engine stops reading until worker catches up
+      return NULL;
+   }
+   return websocket_callback (w, j);
+}
+
+static char *
+websocket_rx_message (websocket_t * w)
+{                               // Process a received message, all fragments in rxdata, returns error to end
+   if (websocket_debug)
+   {
+      fprintf (stderr, "Rx");
+      if (w->rxop == 1)
+         fprintf (stderr, " [%.*s]", (int) w->rxptr, w->rxdata);        // Text frame
+      else
+      {
+         unsigned int p;
+         for (p = 0; p < w->rxptr; p++)
+            fprintf (stderr, " %02X", w->rxdata[p]);    // Binary data
+      }
+      fprintf (stderr, "\n");
+   }
+   if (!w->rxdata && websocket_rx_grow (w, 0, 0))
+      return "Malloc fail";     // Empty message
+   w->rxdata[w->rxptr] = 0;     // Always add a NULL for safety
+   if ((w->rxop == 1 || w->rxop == 2) && w->path)
+   {                            // data, parsed here, callback here or by a worker
+      websocket_job_t j = { 0 };
+#ifdef	USEAXL
+      if (w->path->callbackxmlraw)
+      {                         // Raw callback
+         j.data = w->rxdata;
+         j.len = w->rxptr;
+         w->rxdata = NULL;      // Consumed
+         w->rxlen = 0;
+         w->rxptr = 0;
+         w->rxapp = 0;
+      } else if (w->path->callbackxml)
+      {                         // JSON callback
+         j.xml = xml_tree_parse_json ((char *) w->rxdata, "json");
+         if (!j.xml)
+            return "Bad XML";
+      }
+#endif
+#ifdef	USEAJL
+      if (w->path->callbackjsonraw)
+      {                         // Raw callback
+         j.data = w->rxdata;
+         j.len = w->rxptr;
+         w->rxdata = NULL;      // Consumed
+         w->rxlen = 0;
+         w->rxptr = 0;
+         w->rxapp = 0;
+      }                         // JSON callback is parsed as received (websocket_rx_json)
+#endif
+      char *e = websocket_rx_deliver (w, &j);
+      if (e)
+         return e;
+   }
+   w->rxptr = 0;                // next message
+   w->rxop = 0;
+   w->rxused = time (0);
+   return NULL;
+}
+
+static char *
+websocket_rx_stream (websocket_t * w, size_t len, const unsigned char *data, int end)
+{                               // Pass part of a message to the stream callback, returns error to end
+   int flags = (w->rxstarted ? 0 : WEBSOCKET_RX_START) | (end ? WEBSOCKET_RX_END : 0) | (w->rxop == 2 ? WEBSOCKET_RX_BINARY : 0);
+   if (websocket_debug)
+      fprintf (stderr, "%p Stream callback %zu%s%s\n", w, len, (flags & WEBSOCKET_RX_START) ? " start" : "",
+               (flags & WEBSOCKET_RX_END) ? " end" : "");
+   w->rxstarted = 1;
+   if (end)
+   {                            // next message
+      w->rxstarted = 0;
+      w->rxptr = 0;
+      w->rxop = 0;
+      w->rxused = time (0);
+   }
+   return w->path->callbackrxstream (w, flags, len, data);
+}
+
+#ifdef	USEAJL
+enum
+{                               // Incremental JSON parse states
+   RXJ_VALUE,                   // Value wanted
+   RXJ_FIRST,                   // Value or end of array
+   RXJ_KEY,                     // Name wanted
+   RXJ_KEYFIRST,                // Name or end of object
+   RXJ_COLON,
+   RXJ_AFTER,                   // Comma or end of object/array
+   RXJ_STRING,
+   RXJ_ESC,                     // After backslash in string
+   RXJ_HEX,                     // In \u escape
+   RXJ_LITERAL,                 // Number, true, false or null
+   RXJ_RAW,                     // Top level is not an object or array, collected and parsed at the end
+   RXJ_DONE,
+};
+
+static int
+websocket_rxjson_add (websocket_rxjson_t * p, const unsigned char *d, size_t len)
+{                               // Add to tok, keeping space for a NULL, 0 if OK
+   if (p->toklen + len >= p->tokmax)
+   {
+      size_t n = p->tokmax * 2;
+      while (n <= p->toklen + len)
+         n *= 2;
+      char *t = realloc (p->tok, n);
+      if (!t)
+         return -1;
+      p->tok = t;
+      p->tokmax = n;
+   }
+   memcpy (p->tok + p->toklen, d, len);
+   p->toklen += len;
+   return 0;
+}
+
+static int
+websocket_rxjson_utf8 (websocket_rxjson_t * p, unsigned int u)
+{                               // Add a \u escape to tok as UTF-8, 0 if OK
+   unsigned char b[4];
+   size_t n = 0;
+   if (u < 0x80)
+      b[n++] = u;
+   else if (u < 0x800)
+   {
+      b[n++] = 0xC0 | (u >> 6);
+      b[n++] = 0x80 | (u & 0x3F);
+   } else if (u < 0x10000)
+   {
+      b[n++] = 0xE0 | (u >> 12);
+      b[n++] = 0x80 | ((u >> 6) & 0x3F);
+      b[n++] = 0x80 | (u & 0x3F);
+   } else
+   {
+      b[n++] = 0xF0 | (u >> 18);
+      b[n++] = 0x80 | ((u >> 12) & 0x3F);
+      b[n++] = 0x80 | ((u >> 6) & 0x3F);
+      b[n++] = 0x80 | (u & 0x3F);
+   }
+   return websocket_rxjson_add (p, b, n);
+}
+
+static int
+websocket_rxjson_literal (const char *t)
+{                               // Check literal is true, false, null or a number
+   if (!strcmp (t, "true") || !strcmp (t, "false") || !strcmp (t, "null"))
+      return 1;
+   if (*t == '-')
+      t++;
+   if (*t == '0')
+      t++;
+   else if (isdigit (*t))
+      while (isdigit (*t))
+         t++;
+   else
+      return 0;
+   if (*t == '.')
+   {
+      t++;
+      if (!isdigit (*t))
+         return 0;
+      while (isdigit (*t))
+         t++;
+   }
+   if (*t == 'e' || *t == 'E')
+   {
+      t++;
+      if (*t == '+' || *t == '-')
+         t++;
+      if (!isdigit (*t))
+         return 0;
+      while (isdigit (*t))
+         t++;
+   }
+   return !*t;
+}
+
+static char *
+websocket_rxjson_value (websocket_rxjson_t * p, int string)
+{                               // Store the string or literal in tok in the open object or array
+   p->tok[p->toklen] = 0;
+   if (!string && !websocket_rxjson_literal (p->tok))
+      return "Bad JSON";
+   j_t j = p->stack[p->depth - 1].j;
+   if (p->stack[p->depth - 1].obj)
+   {
+      if (string)
+         j_store_stringn (j, p->name, p->tok, p->toklen);
+      else
+         j_store_literal (j, p->name, p->tok);
+   } else if (string)
+      j_append_stringn (j, p->tok, p->toklen);
+   else
+      j_append_literal (j, p->tok);
+   p->toklen = 0;
+   p->state = RXJ_AFTER;
+   return NULL;
+}
+
+static char *
+websocket_rxjson_open (websocket_rxjson_t * p, int obj)
+{                               // Start an object or array
+   j_t j = p->json;
+   if (!p->depth)
+   {
+      char *e = j_read_mem (j, obj ? "{}" : "[]", 2);
+      if (e)
+         return e;
+   } else if (p->stack[p->depth - 1].obj)
+      j = (obj ? j_store_object : j_store_array) (p->stack[p->depth - 1].j, p->name);
+   else
+      j = (obj ? j_append_object : j_append_array) (p->stack[p->depth - 1].j);
+   if (p->depth == p->stackmax)
+   {
+      int n = (p->stackmax ? : 8) * 2;
+      void *s = realloc (p->stack, n * sizeof (*p->stack));
+      if (!s)
+         return "Malloc fail";
+      p->stack = s;
+      p->stackmax = n;
+   }
+   p->stack[p->depth].j = j;
+   p->stack[p->depth++].obj = obj;
+   p->state = (obj ? RXJ_KEYFIRST : RXJ_FIRST);
+   return NULL;
+}
+
+static void
+websocket_rxjson_close (websocket_rxjson_t * p)
+{                               // End an object or array
+   p->state = (--p->depth ? RXJ_AFTER : RXJ_DONE);
+}
+
+static char *
+websocket_rxjson_feed (websocket_rxjson_t * p, const unsigned char *d, size_t len)
+{                               // Parse the next part of the message, building json, returns error
+   const unsigned char *e = d + len;
+   char *er;
+   while (d < e)
+   {
+      unsigned char c = *d;
+      switch (p->state)
+      {                         // States that take any character
+      case RXJ_RAW:
+         if (websocket_rxjson_add (p, d, e - d))
+            return "Malloc fail";
+         return NULL;
+      case RXJ_STRING:
+         {
+            const unsigned char *s = d;
+            while (s < e && *s != '"' && *s != '\\' && *s >= 0x20)
+               s++;
+            if (s > d)
+            {                   // Plain characters
+               if (p->hi)
+                  return "Bad JSON";    // Surrogate not followed by low surrogate
+               if (websocket_rxjson_add (p, d, s - d))
+                  return "Malloc fail";
+               d = s;
+               continue;
+            }
+         }
+         d++;
+         if (c == '\\')
+            p->state = RXJ_ESC;
+         else if (c != '"' || p->hi)
+            return "Bad JSON";
+         else if (p->key)
+         {                      // Name, kept for the value
+            char *t = p->name;
+            p->name = p->tok;
+            p->tok = t;
+            size_t m = p->namemax;
+            p->namemax = p->tokmax;
+            p->tokmax = m;
+            p->name[p->toklen] = 0;
+            p->toklen = 0;
+            p->state = RXJ_COLON;
+         } else if ((er = websocket_rxjson_value (p, 1)))
+            return er;
+         continue;
+      case RXJ_ESC:
+         d++;
+         p->state = RXJ_STRING;
+         if (p->hi && c != 'u')
+            return "Bad JSON";
+         if (c == 'u')
+         {
+            p->state = RXJ_HEX;
+            p->hex = 4;
+            p->u = 0;
+            continue;
+         }
+         c = (c == 'b' ? '\b' : c == 'f' ? '\f' : c == 'n' ? '\n' : c == 'r' ? '\r' : c == 't' ? '\t' : c == '"'
+              || c == '\\' || c == '/' ? c : 0);
+         if (!c)
+            return "Bad JSON";
+         if (websocket_rxjson_add (p, &c, 1))
+            return "Malloc fail";
+         continue;
+      case RXJ_HEX:
+         d++;
+         if (!isxdigit (c))
+            return "Bad JSON";
+         p->u = (p->u << 4) + (isdigit (c) ? c - '0' : (c & 0xF) + 9);
+         if (--p->hex)
+            continue;
+         p->state = RXJ_STRING;
+         if (p->u >= 0xD800 && p->u < 0xDC00)
+         {                      // High surrogate, low should follow
+            if (p->hi)
+               return "Bad JSON";
+            p->hi = p->u;
+            continue;
+         }
+         if (p->u >= 0xDC00 && p->u < 0xE000)
+         {                      // Low surrogate
+            if (!p->hi)
+               return "Bad JSON";
+            p->u = 0x10000 + ((p->hi - 0xD800) << 10) + (p->u - 0xDC00);
+            p->hi = 0;
+         } else if (p->hi)
+            return "Bad JSON";
+         if (websocket_rxjson_utf8 (p, p->u))
+            return "Malloc fail";
+         continue;
+      case RXJ_LITERAL:
+         if (isalnum (c) || c == '+' || c == '-' || c == '.')
+         {
+            if (websocket_rxjson_add (p, d++, 1))
+               return "Malloc fail";
+            continue;
+         }
+         if ((er = websocket_rxjson_value (p, 0)))
+            return er;
+         continue;              // Character is after the literal
+      }
+      d++;
+      if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+         continue;
+      switch (p->state)
+      {                         // States that skip white space
+      case RXJ_FIRST:
+         if (c == ']')
+         {
+            websocket_rxjson_close (p);
+            continue;
+         }
+         // Fall through
+      case RXJ_VALUE:
+         if (c == '{' || c == '[')
+         {
+            if ((er = websocket_rxjson_open (p, c == '{')))
+               return er;
+         } else if (!p->depth)
+         {                      // Top level string or literal, as is
+            p->state = RXJ_RAW;
+            if (websocket_rxjson_add (p, d - 1, 1))
+               return "Malloc fail";
+         } else if (c == '"')
+         {
+            p->key = 0;
+            p->state = RXJ_STRING;
+         } else if (c == '-' || isalnum (c))
+         {
+            p->state = RXJ_LITERAL;
+            if (websocket_rxjson_add (p, d - 1, 1))
+               return "Malloc fail";
+         } else
+            return "Bad JSON";
+         continue;
+      case RXJ_KEYFIRST:
+         if (c == '}')
+         {
+            websocket_rxjson_close (p);
+            continue;
+         }
+         // Fall through
+      case RXJ_KEY:
+         if (c != '"')
+            return "Bad JSON";
+         p->key = 1;
+         p->state = RXJ_STRING;
+         continue;
+      case RXJ_COLON:
+         if (c != ':')
+            return "Bad JSON";
+         p->state = RXJ_VALUE;
+         continue;
+      case RXJ_AFTER:
+         if (c == ',')
+            p->state = (p->stack[p->depth - 1].obj ? RXJ_KEY : RXJ_VALUE);
+         else if (c == (p->stack[p->depth - 1].obj ? '}' : ']'))
+            websocket_rxjson_close (p);
+         else
+            return "Bad JSON";
+         continue;
+      }
+      return "Bad JSON";        // After the end
+   }
+   return NULL;
+}
+
+static void
+websocket_rxjson_start (websocket_rxjson_t * p)
+{                               // Start of message
+   p->json = j_create ();
+   p->depth = 0;
+   p->toklen = 0;
+   p->hi = 0;
+   p->state = RXJ_VALUE;
+}
+
+static char *
+websocket_rxjson_end (websocket_rxjson_t * p)
+{                               // End of message, parse a top level string or literal, returns error
+   if (p->state == RXJ_RAW)
+      return j_read_mem (p->json, p->tok, p->toklen);
+   if (p->state != RXJ_DONE)
+      return "Bad JSON";
+   return NULL;
+}
+
+static char *
+websocket_rx_json (websocket_t * w, const unsigned char *data, size_t len, int end)
+{                               // Parse part of a message as it arrives for the JSON callback, returns error
+   websocket_rxjson_t *p = w->rxjson;
+   if (!p)
+   {                            // First use
+      if (!(p = w->rxjson = calloc (1, sizeof (*p))) || !(p->tok = malloc (p->tokmax = 256))
+          || !(p->name = malloc (p->namemax = 256)))
+         return "Malloc fail";
+   }
+   if (!p->json)
+      websocket_rxjson_start (p);
+   if (websocket_debug && len)
+      fprintf (stderr, "Rx [%.*s]\n", (int) len, data);
+   char *e = websocket_rxjson_feed (p, data, len);
+   if (!e && end && !(e = websocket_rxjson_end (p)))
+   {                            // Whole message parsed
+      websocket_job_t j = {.json = p->json };
+      p->json = NULL;
+      w->rxptr = 0;             // next message
+      w->rxop = 0;
+      w->rxused = time (0);
+      return websocket_rx_deliver (w, &j);
+   }
+   if (e)
+      j_delete (&p->json);
+   return e;
+}
+#endif
+
+static int
+websocket_rx_parts (websocket_t * w)
+{                               // Message is passed on as it arrives (stream or JSON parse), not collected in rxdata
+   if (w->path->callbackrxstream)
+      return 1;
 #ifdef	USEAXL
-            xml_attribute_t a = xml_attribute_set (xq, query, v ? : "null");
-            if (a && !v)
-               a->json_unquoted = 1;
+   if (w->path->callbackxml || w->path->callbackxmlraw)
+      return 0;
+#endif
+#ifdef	USEAJL
+   if (w->path->callbackjson && !w->path->callbackjsonraw)
+      return 1;
+#endif
+   return 0;
+}
+
+static void
+websocket_rx_refuse (websocket_t * w, unsigned short code)
+{                               // Message refused, the far end sees a close and we discard anything more
+   if (websocket_debug)
+      fprintf (stderr, "Rx message refused (%u) from %s\n", code, w->from);
+   w->rxover = 1;
+   w->rxget = w->rxput;
+   txb_t *txb = txb_new_close (code);
+   if (!txb || !txb_control (w, txb))
+      shutdown (w->socket, SHUT_RDWR);  // Cannot say why, just end it
+   if (txb)
+      txb_done (txb);
+}
+
+static char *
+websocket_rx_inflate (websocket_t * w, const unsigned char *data, size_t len, int end)
+{                               // Decompress part of a message and pass it on, end adds the flush marker and finishes, returns error
+   static const unsigned char tail[] = { 0, 0, 0xFF, 0xFF };
+   websocket_pmd_t *z = w->pmd;
+   size_t max = w->path->rxmax;
+   int parts = websocket_rx_parts (w);
+   if (!z->rxinit)
+   {
+      if (inflateInit2 (&z->rx, -z->rxbits) != Z_OK)
+         return "Inflate fail";
+      z->rxinit = 1;
+   }
+   if (parts && !z->out && !(z->out = malloc (RXBUF)))
+      return "Malloc fail";
+   if (end)
+   {
+      data = tail;
+      len = sizeof (tail);
+   }
+   z->rx.next_in = (unsigned char *) data;
+   z->rx.avail_in = len;
+   do
+   {
+      unsigned char *o;
+      size_t room;
+      if (parts)
+      {
+         o = z->out;
+         room = RXBUF;
+      } else
+      {                         // In to rxdata, growing as needed
+         if (w->rxlen < w->rxptr + RXBUF / 4)
+         {
+            size_t want = w->rxptr + (w->rxptr > RXBUF ? w->rxptr : RXBUF);
+            if (max && want > max)
+               want = max;
+            if (websocket_rx_grow (w, want, 0))
+            {
+               websocket_rx_refuse (w, 1009);   // Message too big
+               return NULL;
+            }
+         }
+         o = w->rxdata + w->rxptr;
+         room = w->rxlen - 1 - w->rxptr;
+         if (!room)
+            room = 1;           // Only at rxmax, the NULL space shows if there is any more
+      }
+      if (max && room > max - w->rxptr + 1)
+         room = max - w->rxptr + 1;
+      z->rx.next_out = o;
+      z->rx.avail_out = room;
+      int r = inflate (&z->rx, Z_SYNC_FLUSH);
+      if (r == Z_STREAM_END)
+         inflateReset (&z->rx); // Final block, anything more is a new stream
+      else if (r != Z_OK && r != Z_BUF_ERROR)
+         return "Bad compressed data";
+      size_t n = room - z->rx.avail_out;
+      w->rxptr += n;
+      if (max && w->rxptr > max)
+      {
+         websocket_rx_refuse (w, 1009); // Message too big
+         return NULL;
+      }
+      if (w->rxop == 1 && websocket_rx_utf8 (w, o, n, 0))
+      {
+         websocket_rx_refuse (w, 1007); // Invalid UTF-8
+         return NULL;
+      }
+      if (!n && r == Z_BUF_ERROR)
+         break;                 // Needs more input
+      char *e = NULL;
+      if (!n)
+         continue;
+      if (w->path->callbackrxstream)
+         e = websocket_rx_stream (w, n, o, 0);
+#ifdef	USEAJL
+      else if (parts)
+         e = websocket_rx_json (w, o, n, 0);
+#endif
+      if (e)
+         return e;
+   }
+   while (z->rx.avail_in || !z->rx.avail_out);
+   if (!end)
+      return NULL;
+   if (w->rxop == 1 && websocket_rx_utf8 (w, NULL, 0, 1))
+   {
+      websocket_rx_refuse (w, 1007);
+      return NULL;
+   }
+   if (w->path->callbackrxstream)
+      return websocket_rx_stream (w, 0, NULL, 1);
+#ifdef	USEAJL
+   if (parts)
+      return websocket_rx_json (w, NULL, 0, 1);
+#endif
+   return websocket_rx_message (w);
+}
+
+static char *
+websocket_rx_frames (websocket_t * w)
+{                               // Process frames from rxbuf, NULL when all used
+   if (w->rxover)
+   {                            // Waiting for close to be sent
+      w->rxget = w->rxput;
+      return NULL;
+   }
+   while (1)
+   {
+      if (w->rxhptr < w->rxhlen)
+      {                         // Header
+         if (w->rxget == w->rxput)
+            return NULL;        // Need more
+         w->rxhead[w->rxhptr++] = w->rxbuf[w->rxget++];
+         if (w->rxhptr == 2)
+         {                      // Work out header length
+            if (w->rxhead[1] & 0x80)
+               w->rxhlen += 4;  // mask
+            int l = (w->rxhead[1] & 0x7F);
+            if (l == 126)
+               w->rxhlen += 2;  // len
+            else if (l == 127)
+               w->rxhlen += 8;  // len
+         }
+         if (w->rxhptr < w->rxhlen)
+            continue;
+         unsigned char *head = w->rxhead;
+         if (websocket_debug)
+         {
+            int p;
+            fprintf (stderr, "Rx Header");
+            for (p = 0; p < w->rxhlen; p++)
+               fprintf (stderr, " %02X", head[p]);
+            fprintf (stderr, "\n");
+         }
+         size_t len = (head[1] & 0x7F);
+         if (len == 126)
+            len = (head[2] << 8) + (head[3]);
+         else if (len == 127)
+         {
+            if (head[2] & 0x80)
+               return "Bad length";     // Most significant bit must be 0 (RFC6455 5.2)
+            len =
+               ((unsigned long long) head[2] << 56) + ((unsigned long long) head[3] << 48) + ((unsigned long long) head[4] << 40) +
+               ((unsigned long long) head[5] << 32) + ((unsigned long long) head[6] << 24) + ((unsigned long long) head[7] << 16) +
+               ((unsigned long long) head[8] << 8) + ((unsigned long long) head[9]);
+         }
+         if (!(head[1] & 0x80))
+            return "Unmasked data";
+         unsigned char op = (head[0] & 0x0F);
+         if ((head[0] & 0x30) || ((head[0] & 0x40) && (!w->pmd || !op || (op & 0x08))))
+            return "Bad RSV";   // Only RSV1, on the first frame of a data message, if compression agreed
+         w->rxleft = len;
+         w->rxmask = 0;
+         w->rxctlen = 0;
+         if (op & 0x08)
+         {                      // Control frame, can be between fragments so has its own buffer
+            if (len > sizeof (w->rxctl) || !(head[0] & 0x80))
+               return "Bad control frame";
+            continue;
+         }
+         if (!op == !w->rxop)
+            return "Bad fragment";      // Continuation without a start, or new message before the end
+         if (op)
+         {
+            w->rxop = op;
+            w->rxz = ((head[0] & 0x40) ? 1 : 0);
+            w->rxu8n = 0;
+         }
+         if (len > SIZE_MAX - w->rxptr - 1)
+            return "Bad length";        // Would wrap
+         if ((w->path && w->path->rxmax && len > w->path->rxmax - w->rxptr)
+             || (!w->rxz && !websocket_rx_parts (w) && websocket_rx_grow (w, w->rxptr, len)))
+         {                      // Too big
+            websocket_rx_refuse (w, 1009);
+            return NULL;
+         }
+      }
+      int control = (w->rxhead[0] & 0x08),
+         fin = (w->rxhead[0] & 0x80),
+         parts = (!control && websocket_rx_parts (w));
+      if (w->rxleft)
+      {                         // Payload
+         if (w->rxget == w->rxput)
+            return NULL;        // Need more
+         size_t len = w->rxput - w->rxget;
+         if (len > w->rxleft)
+            len = w->rxleft;
+         unsigned char *i = w->rxbuf + w->rxget,
+            *p = (control ? w->rxctl + w->rxctlen : (parts || w->rxz) ? i : w->rxdata + w->rxptr);      // Unmasked in place unless collecting
+         w->rxmask = websocket_unmask (p, i, len, w->rxhead + w->rxhlen - 4, w->rxmask);
+         w->rxget += len;
+         w->rxleft -= len;
+         if (control)
+            w->rxctlen += len;
+         else if (w->rxz)
+         {
+            char *e = websocket_rx_inflate (w, p, len, 0);
+            if (e)
+               return e;
+            if (w->rxover)
+               return NULL;
+         } else if (w->rxop == 1 && websocket_rx_utf8 (w, p, len, fin && !w->rxleft))
+         {                      // Checked while still in cache
+            websocket_rx_refuse (w, 1007);      // Invalid UTF-8
+            return NULL;
+         } else
+         {
+            w->rxptr += len;
+            char *e = NULL;
+            if (w->path->callbackrxstream)
+               e = websocket_rx_stream (w, len, p, fin && !w->rxleft);  // Pass on as it arrives
+#ifdef	USEAJL
+            else if (parts)
+               e = websocket_rx_json (w, p, len, fin && !w->rxleft);    // Parse as it arrives, while still in cache
 #endif
+            if (e)
+               return e;
+         }
+         if (w->rxleft)
+            return NULL;        // Need more
+      }
+      // Frame complete
+      w->rxhptr = 0;
+      w->rxhlen = 2;
+      char *e = NULL;
+      if (control)
+         e = websocket_rx_control (w);
+      else if (fin && w->rxop)
+      {                         // End of data
+         if (w->rxz)
+            e = websocket_rx_inflate (w, NULL, 0, 1);
+         else if (w->rxop == 1 && websocket_rx_utf8 (w, NULL, 0, 1))
+         {                      // Text ends part way through a sequence
+            websocket_rx_refuse (w, 1007);
+            return NULL;
+         } else if (w->path->callbackrxstream)
+            e = websocket_rx_stream (w, 0, NULL, 1);
 #ifdef	USEAJL
-            j_store_string (jq, query, v);
+         else if (parts)
+            e = websocket_rx_json (w, NULL, 0, 1);
 #endif
+         else
+            e = websocket_rx_message (w);
+      }
+      if (e)
+         return e;
+   }
+}
 
-            query = p;
+static char *
+websocket_rx_start (websocket_t * w)
+{                               // Connected, anything read after the request is frames
+   unsigned char *hs = w->rxdata;
+   w->rxdata = NULL;
+   w->rxlen = 0;
+   w->rxbuf = hs;
+   w->rxget = w->rxwant;
+   w->rxput = w->rxptr;
+   w->rxptr = 0;
+   w->rxhlen = 2;
+   w->rxused = time (0);
+   char *e = websocket_rx_frames (w);
+   free (hs);
+   w->rxbuf = NULL;
+   return e;
+}
+
+char *
+websocket_do_rx (websocket_t * w)
+{                               // Rx thread
+   if (w->bind->keyfile)
+   {                            // SSL set up
+      char *e = websocket_ssl (w);
+      if (e)
+         return e;
+      int r = SSL_accept (w->ss);
+      if (r != 1)
+         return "Could not establish SSL client connection";
+   }
+   while (1)
+   {                            // Rx initial handshake
+      const char *e = NULL;
+      int r = websocket_request (w, &e);
+      if (r < 0)
+         return (char *) e;
+      if (r)
+         break;
+      if (w->rxcont)
+      {                         // Tell the client to send the body
+         static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+         size_t p = 0;
+         w->rxcont = 0;
+         while (p < sizeof (cont) - 1)
+         {
+            ssize_t len = websocket_write (w, cont + p, sizeof (cont) - 1 - p);
+            if (len <= 0)
+               return "Connection closed in handshake";
+            p += len;
          }
       }
-#ifdef	USEAXL
-      xml_t xhttp = xhead;
-      xhttp = xml_element_add (xhead, "http");  // Sub object if using raw logic
-      xml_element_set_content (xhttp, (char *) p);      // The URL
-#endif
-#ifdef	USEAJL
-      j_t jhttp = j_store_object (jhead, "http");
-      j_store_string (jhttp, "url", (char *) p);
-#endif
-      p = eol;                  // Start of headers
-      char *session = NULL;
-      // Extract headers
-      while (p < e)
-      {
-         unsigned char *eol = p;
-         while (eol < e)
-         {                      // End of line
-            while (eol < e && *eol >= ' ')
-               eol++;
-            if (eol + 3 < e && eol[0] == '\r' && eol[1] == '\n' && (eol[2] == ' ' || eol[2] == '\t'))
-            {
-               eol += 2;
-               continue;
-            }
-            break;
+      if (!w->ss || !SSL_pending (w->ss))
+      {
+         struct pollfd p = { w->socket, POLLIN, 0 };
+         int s = poll (&p, 1, 10000);
+         if (s <= 0)
+         {
+            if (websocket_debug)
+               fprintf (stderr, "Rx handshake [%.*s]\n", (int) w->rxptr, w->rxdata);
+            return "Handshake timeout";
          }
-         if (eol < e && *eol == '\r')
-            *eol++ = 0;
-         if (eol < e && *eol == '\n')
-            *eol++ = 0;
-         unsigned char *eoh = p;
-         for (; eoh < e && (isalnum (*eoh) || *eoh == '-'); eoh++)
-            *eoh = tolower (*eoh);
-         while (p < eol && *eoh == ' ')
-            *eoh++ = 0;
-         if (*eoh == ':')
-            *eoh++ = 0;
-         while (eoh < eol && *eoh == ' ')
-            *eoh++ = 0;
-         if (!strcmp ((char *) p, "authorization") && !strncasecmp ((char *) eoh, "Basic ", 6))
+      }
+      if (w->rxlen - w->rxptr < 1000)
+      {
+         unsigned char *n = realloc (w->rxdata, w->rxlen + 1000);
+         if (!n)
+            return "Malloc fail";
+         w->rxdata = n;
+         w->rxlen += 1000;
+      }
+      ssize_t len = websocket_read (w, w->rxdata + w->rxptr, w->rxlen - w->rxptr - 1);
+      if (!len && w->rxep && w->rxwant == SIZE_MAX)
+         w->rxeof = 1;          // Body ends with connection close
+      else if (len <= 0)
+         return "Connection closed in handshake";
+      w->rxptr += len;
+   }
+   {
+      char *er = websocket_handshake (w);
+      if (er)
+         return er;             // Error
+   }
+
+   char *e = websocket_rx_start (w);
+   if (e)
+      return e;
+   if (!(w->rxbuf = malloc (RXBUF)))
+      return "Malloc fail";
+   while (1)
+   {                            // Rx websocket packets, as many as one read gets
+      if (w->rxdata && w->path && w->path->rxidle && (!w->ss || !SSL_pending (w->ss)))
+      {                         // Wait no longer than rxidle before considering freeing the message buffer
+         struct pollfd p = { w->socket, POLLIN, 0 };
+         if (!poll (&p, 1, w->path->rxidle * 1000))
+            websocket_rx_idle (w);
+      }
+      ssize_t len = websocket_read (w, w->rxbuf, RXBUF);
+      if (len <= 0)
+         return NULL;           // closed
+      w->rxget = 0;
+      w->rxput = len;
+      if ((e = websocket_rx_frames (w)))
+         return e;
+   }
+}
+
+static ssize_t
+websocket_response (const char *e, char **resp)
+{                               // Make HTTP response for a handshake error/response
+   char *res = NULL;
+   size_t len = 0;
+   if (*e == '@')
+   {                            // Send a file!
+      FILE *o = open_memstream (&res, &len);
+      FILE *i = fopen (e + 1, "r");
+      if (i)
+      {
+         fprintf (o, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Type: ");
+         char *p = strrchr (e + 1, '.') ? : ".plain";
+         if (!strcasecmp (p, ".png"))
+            fprintf (o, "image/png");
+         else if (!strcasecmp (p, ".svg"))
+            fprintf (o, "image/svg+xml");
+         else if (!strcasecmp (p, ".js"))
+            fprintf (o, "text/javascript");
+         else
+            fprintf (o, "text/%s", p + 1);
+         fprintf (o, "\r\n\r\n");
+         while (1)
          {
-            eoh += 6;
-            while (*eoh == ' ')
-               eoh++;
-            unsigned char *data = NULL;
-#ifdef	USEAXL
-            {
-               int l = xml_base64d ((char *) eoh, &data);
-               if (data)
-               {
-                  data = realloc (data, l + 1);
-                  data[l] = 0;
-                  xml_attribute_set (xhttp, (char *) p, (char *) data);
-                  free (data);
-               }
-            }
-#endif
-#ifdef	USEAJL
-            {
-               int l = j_base64d ((char *) eoh, &data);
-               if (data)
-               {
-                  j_store_stringn (jhttp, (char *) p, (char *) data, l);
-                  free (data);
-               }
-            }
-#endif
-         } else
+            char buf[10240];
+            size_t l = fread (buf, 1, sizeof (buf), i);
+            if (l <= 0)
+               break;
+            fwrite (buf, l, 1, o);
+         }
+         fclose (i);
+      } else
+         fprintf (o, "HTTP/1.1 404 Not found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot found");
+      fclose (o);
+   } else if (*e == '>')
+      len = asprintf (&res, "HTTP/1.1 302 Moved\r\nLocation: %s\r\nConnection: close\r\n\r\n", e + 1);  // Redirect
+   else if (*e == '*')
+      len = asprintf (&res, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s", e + 1);       // General data
+   else if (!strncmp (e, "204 ", 4))
+      len = asprintf (&res, "HTTP/1.1 %s\r\nConnection: close\r\n\r\n", e);     // No content
+   else if (!strncmp (e, "401 ", 4))
+      len = asprintf (&res, "HTTP/1.1 401 Unauthorised\r\nWWW-Authenticate: Basic realm=\"%s\"\r\nConnection: close\r\n\r\nLogin required", e + 4);     // No content
+   else if (isdigit (e[0]) && isdigit (e[1]) && isdigit (e[2]) && e[3] == ' ')  // Error message
+      len = asprintf (&res, "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s", e, e + 4);
+   else
+      len = asprintf (&res, "HTTP/1.1 500 %s\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s", e, e);        // General error
+   *resp = res;
+   return len;
+}
+
+void *
+websocket_rx (void *p)
+{                               // Rx thread
+   sigignore (SIGPIPE);
+   websocket_t *w = p;
+   char *e = websocket_do_rx (w);
+   if (e && websocket_debug)
+      fprintf (stderr, "Rx socket response: %s\n", e);
+   if (!w->connected)
+   {                            // Error...
+      char *res = NULL;
+      ssize_t len = websocket_response (e, &res);
+      if (len > 0)
+      {
+         ssize_t ptr = 0;
+         while (ptr < len)
          {
-#ifdef	USEAXL
-            xml_attribute_set (xhttp, (char *) p, (char *) eoh);
+            ssize_t sent = websocket_write (w, res + ptr, len - ptr);
+            if (sent <= 0)
+               break;
+            ptr += sent;
+         }
+      }
+      free (res);
+   }
+   if (e && (*e == '*' || *e == '@' || *e == '>'))
+      free (e);                 // Malloc'd
+   websocket_rx_free (w, w->rxdata, w->rxapp);
+   w->rxdata = NULL;
+   w->rxapp = 0;
+   pthread_mutex_lock (&w->mutex);
+   if (w->pipe[1] >= 0)
+      close (w->pipe[1]);       // stop tx
+   w->pipe[1] = -1;
+   pthread_mutex_unlock (&w->mutex);
+   pthread_exit (NULL);
+   return NULL;
+}
+
+static websocket_t *
+websocket_new (websocket_bind_t * b, int s, struct sockaddr_in6 *addr, websocket_reactor_t * r)
+{                               // New connection
+   websocket_t *w = pool_alloc (&pools[POOL_WS]);
+   if (!w)
+   {
+      warnx ("Malloc fail");
+      close (s);
+      return NULL;
+   }
+   char *from = w->from;
+   if (addr->sin6_family == AF_INET)
+      inet_ntop (addr->sin6_family, &((struct sockaddr_in *) addr)->sin_addr, from, sizeof (w->from));
+   else
+      inet_ntop (addr->sin6_family, &addr->sin6_addr, from, sizeof (w->from));
+   if (!strncmp (from, "::ffff:", 7) && strchr (from, '.'))
+      memmove (from, from + 7, strlen (from + 7) + 1);
+   if (websocket_debug)
+      fprintf (stderr, "Accepted connection from %s\n", from);
+   pthread_mutex_init (&w->mutex, NULL);
+   pthread_mutex_init (&w->submutex, NULL);
+   pthread_mutex_init (&w->cmutex, NULL);
+   w->bind = b;
+   w->socket = s;
+   w->reactor = r;
+   w->txq = &w->txstub;
+   atomic_init (&w->txe, &w->txstub);
+   w->pipe[0] = w->pipe[1] = -1;
+   int one = 1;
+   if (b->zerocopy && !b->keyfile
+#ifdef	USEURING
+       && !(r && r->uring)
 #endif
-#ifdef	USEAJL
-            j_store_string (jhttp, (char *) p, (char *) eoh);
+       && !setsockopt (s, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof (one)))
+      w->zc = 1;
+   if (!r && pipe ((int *) w->pipe))
+   {                            // Failed to make pipe even, that is bad
+      if (websocket_debug)
+         fprintf (stderr, "Cannot make pipe\n");
+      pool_free (&pools[POOL_WS], w);
+      close (s);
+      return NULL;
+   }
+   return w;
+}
+
+void *
+websocket_listen (void *p)
+{                               // Listen thread
+   sigignore (SIGPIPE);
+   websocket_listener_t *l = p;
+   websocket_bind_t *b = l->bind;
+   while (1)
+   {
+      struct sockaddr_in6 addr = { 0 };
+      socklen_t len = sizeof (addr);
+      int s = accept4 (l->socket, (void *) &addr, &len, SOCK_CLOEXEC);  // Blocking, as rx/tx threads expect
+      if (s < 0)
+      {
+         warn ("Bad accept");
+         continue;
+      }
+      websocket_t *w = websocket_new (b, s, &addr, NULL);
+      if (!w)
+         continue;
+      // Link in
+      pthread_mutex_lock (&b->mutex);
+      w->next = b->sessions;
+      b->sessions = w;
+      pthread_mutex_unlock (&b->mutex);
+      // Threads (tx cleans up, so started last)
+      pthread_t t;
+      if (pthread_create (&t, NULL, websocket_rx, w))
+      {                         // No rx task, close things and free
+         if (websocket_debug)
+            fprintf (stderr, "Cannot make rx thread\n");
+         pthread_mutex_lock (&w->mutex);
+         close (w->pipe[1]);    // Tells tx thread to give up and close/free
+         w->pipe[1] = -1;
+         pthread_mutex_unlock (&w->mutex);
+         close (s);
+         continue;
+      }
+      pthread_detach (t);
+      if (pthread_create (&t, NULL, websocket_tx, w))
+      {                         // Failed to make tx thread
+         if (websocket_debug)
+            fprintf (stderr, "Cannot make tx thread\n");
+         pthread_mutex_lock (&w->mutex);
+         close (w->pipe[0]);
+         w->pipe[0] = -1;
+         close (w->pipe[1]);
+         w->pipe[1] = -1;
+         pthread_mutex_unlock (&w->mutex);
+         pool_free (&pools[POOL_WS], w);        // Problematic if rx task running.
+         continue;
+      }
+      pthread_detach (t);
+   }
+   return NULL;
+}
+
+static void
+websocket_ev_want (websocket_t * w, uint32_t out)
+{                               // Set epoll events, EPOLLOUT if waiting to send
+   if (w->uring)
+      return;                   // Not using epoll
+   uint32_t events = (w->txres || w->throttled ? 0 : EPOLLIN) | out;
+   if (w->events == events)
+      return;
+   w->events = events;
+   struct epoll_event ev = { events, {.ptr = w} };
+   epoll_ctl (w->reactor->epoll, EPOLL_CTL_MOD, w->socket, &ev);
+}
+
+static void
+websocket_ev_close (websocket_t * w)
+{                               // Close socket (event engine), freed at end of reactor pass
+   websocket_reactor_t *r = w->reactor;
+   if (w->dead)
+      return;
+   if (websocket_debug)
+      fprintf (stderr, "Closed connection from %s\n", w->from);
+   if (!w->uring)
+      epoll_ctl (r->epoll, EPOLL_CTL_DEL, w->socket, NULL);
+#ifdef	USEURING
+   if (w->connected && !w->closed && !w->txsends)
+#else
+   if (w->connected && !w->closed)
 #endif
+   {                            // close
+      char end[2] = { 0x88, 0x00 };
+      websocket_write (w, end, 2);
+   }
+   if (w->ss)
+   {
+      SSL_shutdown (w->ss);
+      SSL_free (w->ss);
+      w->ss = NULL;
+   }
+   if (w->uring)
+      shutdown (w->socket, SHUT_RDWR);  // Ends io_uring operations, closed when freed so fd not reused while they complete
+   else
+   {
+      close (w->socket);
+      w->socket = -1;
+   }
+   pthread_mutex_lock (&r->mutex);
+   w->dead = 1;                 // Stops further kicks
+   if (w->kicked)
+   {
+      websocket_t **ww;
+      for (ww = &r->kick; *ww && *ww != w; ww = &(*ww)->knext);
+      if (*ww)
+         *ww = w->knext;
+      w->kicked = 0;
+   }
+   pthread_mutex_unlock (&r->mutex);
+   if (w->rprev)
+      w->rprev->rnext = w->rnext;
+   else
+      r->sessions = w->rnext;
+   if (w->rnext)
+      w->rnext->rprev = w->rprev;
+   w->rnext = r->dead;
+   r->dead = w;
+}
+
+#ifdef	USEURING
+static struct io_uring_sqe *
+websocket_ur_sqe (websocket_reactor_t * r, void *data)
+{                               // Get a submission queue entry (io_uring), submitting queued entries if full
+   struct io_uring_sqe *sqe;
+   while (!(sqe = io_uring_get_sqe (&r->ring)))
+      io_uring_submit (&r->ring);
+   io_uring_sqe_set_data (sqe, data);
+   return sqe;
+}
+
+static void
+websocket_ur_tx (websocket_t * w)
+{                               // Start sending what is queued (io_uring), completions carry on when done
+   websocket_reactor_t *r = w->reactor;
+   if (w->dead || w->txsends)
+      return;
+   if (w->txfail || w->closed)
+   {
+      websocket_ev_close (w);
+      return;
+   }
+   struct msghdr *m = w->txmsg;
+   struct iovec *iov = (void *) (m + 1);
+   int n = 0;
+   if (!w->connected)
+   {                            // Sending HTTP response, then close
+      txb_t *b = w->txres;
+      if (!b)
+         return;
+      if (w->txptr >= b->len)
+      {
+         if (w->txcont)
+         {                      // 100 Continue sent, read the rest of the request
+            w->txres = NULL;
+            w->txcont = 0;
+            w->txptr = 0;
+            txb_done (b);
+            return;
          }
-         if (!strcmp ((char *) p, "cookie"))
-         {                      // Scan for our session cookie
-            char *data = (char *) eoh;
-            int l = strlen (wscookie);
-            while (*data)
-            {
-               while (*data && isspace (*data))
-                  data++;
-               if (!strncmp (data, wscookie, l) && !isalnum (data[l]))
-               {                // Looks like our cookie
-                  data += l;
-                  while (*data && isspace (*data))
-                     data++;
-                  if (*data == '=')
-                  {
-                     data++;
-                     while (*data && isspace (*data))
-                        data++;
-                     char *e = data;
-                     while (*e && *e != ';')
-                        e++;
-                     while (e > data && isspace (e[-1]))
-                        e--;
-                     session = malloc (e + 1 - data);
-                     if (!session)
-                        errx (1, "malloc");
-                     memcpy (session, data, e - data);
-                     session[e - data] = 0;
-                  }
-                  break;
-               }
-               while (*data && *data != ';')
-                  data++;
-               if (*data == ';')
-                  data++;
-            }
-         }
-         p = eol;
-         if (p == e || *p < ' ')
-            break;              // Odd
+         websocket_ev_close (w);
+         return;
       }
-      if (!session)
-      {                         // Make a session id
-         session = malloc (65);
-         if (!session)
-            errx (1, "malloc");
-         int r = open ("/dev/urandom", O_RDONLY);
-         if (r < 0)
-            err (1, "Random");
-         if (read (r, session, 64) != 64)
-            err (1, "Random");
-         int p;
-         for (p = 0; p < 64; p++)
-            session[p] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"[session[p] & 31];
-         session[p] = 0;
-         close (r);
-      }
-      const char *host = NULL,
-         *origin = NULL;
-#ifdef	USEAXL
-      xml_add (xhead, "@session", session);
-      host = xml_get (xhttp, "@host");
-      origin = xml_get (xhttp, "@origin");
-      xml_attribute_set (xhead, "IP", w->from);
+      n = txb_iov (b, w->txptr, iov);
+   } else
+      n = websocket_txq_iov (w, iov, NULL, TXIOV);      // As much as we can, sent in order
+   if (!n)
+   {
+      if (w->connected && atomic_load (&w->txn))
+         websocket_kick (w);    // Being linked in, no further wake up for it, so try again
+      return;
+   }
+   memset (m, 0, sizeof (*m));
+   m->msg_iov = iov;
+   m->msg_iovlen = n;
+   struct io_uring_sqe *sqe = websocket_ur_sqe (r, (void *) ((uintptr_t) w | 3));
+   io_uring_prep_sendmsg (sqe, w->socket, m, MSG_WAITALL);
+   w->inflight++;
+   w->txsends++;
+}
 #endif
-#ifdef	USEAJL
-      j_store_string (jhead, "session", session);
-      host = j_get (jhttp, "host");
-      origin = j_get (jhttp, "origin");
-      j_store_string (jhead, "IP", w->from);
+
+static void
+websocket_ev_tx (websocket_t * w)
+{                               // Send what we can (event engine)
+#ifdef	USEURING
+   if (w->uring)
+   {
+      websocket_ur_tx (w);
+      return;
+   }
 #endif
-      int mismatch (const char *ref, const char *val)
+   if (w->dead || (w->ss && !w->sslok))
+      return;
+   if (!w->connected)
+   {                            // Sending HTTP response, then close
+      txb_t *b = w->txres;
+      if (!b)
+         return;
+      while (w->txptr < b->len)
       {
-         if (!ref)
-            return 0;           // OK
-         if (!val)
-            return 1;           // Bad
-         return strcmp (ref, val);      // comp
+         ssize_t len = websocket_write (w, b->buf + w->txptr, b->len - w->txptr);
+         if (len < 0 && errno == EAGAIN)
+         {
+            websocket_ev_want (w, EPOLLOUT);
+            return;
+         }
+         if (len <= 0)
+            break;
+         w->txptr += len;
       }
-      websocket_path_t *path;
-      for (path = w->bind->paths;
-           path && (mismatch (path->origin, origin) || mismatch (path->host, host) || mismatch (path->path, url));
-           path = path->next);
-      if (!path)
+      if (w->txcont && w->txptr >= b->len)
+      {                         // 100 Continue sent, read the rest of the request
+         w->txres = NULL;
+         w->txcont = 0;
+         w->txptr = 0;
+         txb_done (b);
+         websocket_ev_want (w, 0);
+         return;
+      }
+      websocket_ev_close (w);
+      return;
+   }
+   while (txq_waiting (w))
+   {                            // As much of the queue as we can in one write
+      ssize_t len = websocket_txq_write (w);
+      if (len < 0 && errno == EAGAIN)
       {
-#ifdef	USEAXL
-         if (xhead)
-            xml_tree_delete (xhead);
-#endif
-#ifdef	USEAJL
-         j_delete (&jhead);
-#endif
-         free (session);
-         return "Path not found";
+         websocket_ev_want (w, EPOLLOUT);
+         return;
       }
-      w->path = path;
-      char *er = NULL;
-      const char *v = NULL;
-#ifdef	USEAXL
-      v = xml_get (xhttp, "@upgrade");
-#endif
-#ifdef	USEAJL
-      v = j_get (jhttp, "upgrade");
-#endif
-      const char *method = NULL;
-#ifdef	USEAXL
-      method = xml_element_name (xhead);
-#endif
-#ifdef	USEAJL
-      method = j_get (jhead, "method");
-#endif
-      if (!method)
-         return "No method";
-      if (!v)
-      {                         // HTTP
-         const char *cl = NULL,
-            *expect = NULL;
-#ifdef	USEAXL
-         cl = xml_get (xhttp, "@content-length");
-         expect = xml_get (xhttp, "@expect");
-#endif
-#ifdef	USEAJL
-         cl = j_get (jhttp, "content-length");
-         expect = j_get (jhttp, "expect");
-#endif
-         if (!strcasecmp (method, "post") || expect || cl)
-         {                      // data to receive
-            if (ep < w->rxptr)
-            {
-               memmove (w->rxdata, w->rxdata + ep, w->rxptr - ep);
-               w->rxptr -= ep;
-            } else
-            {
-               free (w->rxdata);
-               w->rxdata = NULL;
-               w->rxptr = 0;
-               w->rxlen = 0;
-            }
-            size_t max = 0;
-            if (cl)
-            {
-               max = strtoull (cl, NULL, 10);
-               w->rxdata = realloc (w->rxdata, w->rxlen = max + 1);
-               if (!w->rxdata)
-                  er = "Malloc fail";
-            }
-            if (expect && !strncmp (expect, "100", 3))
-            {
-               char *reply = "HTTP/1.1 100 Continue\r\n\r\n";
-               if (w->ss)
-                  SSL_write (w->ss, reply, strlen (reply));
-               else
-                  send (w->socket, reply, strlen (reply), 0);
-            }
-            if (!er)
-            {
-               while (1)
-               {
-                  if (max && w->rxptr == max)
-                     break;
-                  if (!max && w->rxlen - w->rxptr < 1000)
-                     w->rxdata = realloc (w->rxdata, w->rxlen += 1000);
-                  ssize_t len = 0;
-                  if (w->ss)
-                     len = SSL_read (w->ss, w->rxdata + w->rxptr, w->rxlen - w->rxptr - 1);
-                  else
-                     len = recv (w->socket, w->rxdata + w->rxptr, w->rxlen - w->rxptr - 1, 0);
-                  if (!len)
-                     break;     // End of input
-                  if (len < 0)
-                  {
-                     er = "Connection closed in handshake";
-                     break;
-                  }
-                  w->rxptr += len;
-               }
-               w->rxdata[w->rxptr] = 0;
-               if (websocket_debug)
-                  fprintf (stderr, "Parse [%s]\n", (char *) w->rxdata);
-#ifdef	USEAXL
-               if (w->path && w->path->callbackxmlraw)
-               {                // Raw data callback
-                  if (websocket_debug)
-                     fprintf (stderr, "%p Post callback\n", w);
-                  er = w->path->callbackxmlraw (NULL, xhead, w->rxptr, w->rxdata);
-                  xhead = NULL; // assumed to consume head/data
-                  w->rxdata = NULL;     // consumed
-                  w->rxptr = 0;
-               } else if (w->path && w->path->callbackxml)
-               {                // Note can call a post with null if nothing posted
-                  xml_t data = xml_tree_parse_json ((char *) w->rxdata, "json");
-                  if (websocket_debug)
-                     fprintf (stderr, "%p Post callback\n", w);
-                  er = w->path->callbackxml (NULL, xhead, data);
-                  xhead = NULL; // assumed to consume head/data
-               }
-#endif
-#ifdef	USEAJL
-               if (w->path && w->path->callbackjsonraw)
-               {                // Raw data callback
-                  if (websocket_debug)
-                     fprintf (stderr, "%p Post callback\n", w);
-                  er = w->path->callbackjsonraw (NULL, jhead, w->rxptr, w->rxdata);
-                  jhead = NULL; // assumed consumed
-                  w->rxdata = NULL;     // consumed
-                  w->rxptr = 0;
-               } else if (w->path && w->path->callbackjson)
-               {                // Note can call a post with null if nothing posted
-                  j_t data = j_create ();
-                  if (j_read_mem (data, (char *) w->rxdata, w->rxptr))
-                     j_delete (&data);
-                  if (websocket_debug)
-                     fprintf (stderr, "%p Post callback\n", w);
-                  er = w->path->callbackjson (NULL, jhead, data);
-                  jhead = NULL; // assumed consumed
-               }
-#endif
-            }
-         } else
+      if (len < 0)
+      {
+         websocket_ev_close (w);
+         return;
+      }
+      if (!len)
+         break;                 // Nothing that can be sent yet
+      websocket_sent (w, len);
+      if (w->closed)
+      {
+         websocket_ev_close (w);
+         return;
+      }
+      txq_t *q = txq_first (w);
+      if (q && q->data->stream && !q->data->stream->opcode)
+      {                         // Part way through a stream, let rx have a look in before the next fragment
+         websocket_ev_want (w, EPOLLOUT);
+         return;
+      }
+   }
+   if (atomic_load (&w->txn))
+      websocket_kick (w);       // Being linked in, no further wake up for it, so try again
+   websocket_ev_want (w, 0);
+}
+
+static void
+websocket_ev_fail (websocket_t * w, char *e)
+{                               // Rx has ended (event engine), send HTTP response if not connected, and close
+   if (e && websocket_debug)
+      fprintf (stderr, "Rx socket response: %s\n", e);
+   if (!w->connected && e)
+   {                            // Error...
+      char *res = NULL;
+      ssize_t len = websocket_response (e, &res);
+      if (len > 0)
+      {
+         if ((w->txres = txb_new_data (len, (unsigned char *) res)))
          {
-#ifdef	USEAXL
-            if (w->path && w->path->callbackxmlraw)
-            {
-               if (websocket_debug)
-                  fprintf (stderr, "%p Get callback\n", w);
-               er = w->path->callbackxmlraw (NULL, xhead, 0, NULL);
-               xhead = NULL;
-            } else if (w->path && w->path->callbackxml)
-            {
-               if (websocket_debug)
-                  fprintf (stderr, "%p Get callback\n", w);
-               er = w->path->callbackxml (NULL, xhead, NULL);
-               xhead = NULL;
-            }
-#endif
-#ifdef	USEAJL
-            if (w->path && w->path->callbackjsonraw)
-            {
-               if (websocket_debug)
-                  fprintf (stderr, "%p Get callback\n", w);
-               er = w->path->callbackjsonraw (NULL, jhead, 0, NULL);
-               jhead = NULL;    // assumed consumed
-            } else if (w->path && w->path->callbackjson)
-            {
-               if (websocket_debug)
-                  fprintf (stderr, "%p Get callback\n", w);
-               er = w->path->callbackjson (NULL, jhead, NULL);
-               jhead = NULL;    // assumed consumed
-            }
-#endif
-         }
-         if (!er)
-            er = "204 No content";
+            w->txres->hlen = 0; // Raw
+            w->txptr = 0;
+         } else
+            free (res);         // Just close
       } else
-      {                         // Web socket
-         host = strdupa (host); // We free before using it otherwise
-         {                      // Strip port
-            char *p = strrchr (host, ':');
-            if (p)
-               *p = 0;
-         }
-         unsigned char hash[SHA_DIGEST_LENGTH] = { };
-         if (strcasecmp (method, "get"))
-            er = "Bad request (not GET)";
-         if (strcasecmp (v, "websocket"))
-            er = "Bad upgrade header (not websocket)";
-         v = NULL;
-#ifdef	USEAXL
-         v = xml_get (xhttp, "@sec-websocket-version");
-#endif
-#ifdef	USEAJL
-         v = j_get (jhttp, "sec-websocket-version");
-#endif
-         if (!v)
-            er = "No version";
-         else if (atoi (v) != 13)
-            er = "Bad version (not 13)";
-         v = NULL;
-#ifdef	USEAXL
-         v = xml_get (xhttp, "@sec-websocket-key");
-#endif
-#ifdef	USEAJL
-         v = j_get (jhttp, "sec-websocket-key");
-#endif
-         if (!v)
-            er = "No websocket key";
+         free (res);
+   }
+   if (e && (*e == '*' || *e == '@' || *e == '>'))
+      free (e);                 // Malloc'd
+   if (!w->txres)
+   {
+      websocket_ev_close (w);
+      return;
+   }
+   websocket_ev_want (w, 0);    // No more rx
+   websocket_ev_tx (w);
+}
+
+static int
+websocket_ev_request (websocket_t * w)
+{                               // Check request received so far (event engine), handshake if complete, 0 if more needed
+   const char *re = NULL;
+   int r = websocket_request (w, &re);
+   if (!r && w->rxcont)
+   {                            // Tell the client to send the body, reading waits until sent
+      static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+      unsigned char *buf = malloc (sizeof (cont) - 1);
+      w->rxcont = 0;
+      if (buf && (w->txres = txb_new_data (sizeof (cont) - 1, buf)))
+      {
+         memcpy (buf, cont, sizeof (cont) - 1);
+         w->txres->hlen = 0;    // Raw
+         w->txptr = 0;
+         w->txcont = 1;
+         websocket_ev_tx (w);
+      } else
+         free (buf);            // The client sends the body anyway after a while
+   }
+   if (!r)
+      return 0;
+   if (r < 0)
+   {
+      websocket_ev_fail (w, (char *) re);
+      return 1;
+   }
+   char *e = websocket_handshake (w);
+   if (e)
+   {
+      websocket_ev_fail (w, e);
+      return 1;
+   }
+   w->when = time (0) + 2;      // First ping
+   e = websocket_rx_start (w);
+   if (!e && !w->uring && !(w->rxbuf = malloc (RXBUF)))
+      e = "Malloc fail";        // io_uring uses its own buffers
+   if (e)
+      websocket_ev_fail (w, e);
+   return 1;
+}
+
+static void
+websocket_ev_rx (websocket_t * w)
+{                               // Receive what we can (event engine)
+   if (w->dead || w->txres || w->throttled)
+      return;
+   if (w->ss && !w->sslok)
+   {                            // SSL accept
+      ERR_clear_error ();
+      int r = SSL_accept (w->ss);
+      if (r != 1)
+      {
+         int e = SSL_get_error (w->ss, r);
+         if (e == SSL_ERROR_WANT_READ)
+            websocket_ev_want (w, 0);
+         else if (e == SSL_ERROR_WANT_WRITE)
+            websocket_ev_want (w, EPOLLOUT);
          else
-         {
-            SHA_CTX c;
-            SHA1_Init (&c);
-            SHA1_Update (&c, v, strlen (v));
-            SHA1_Update (&c, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
-            SHA1_Final (hash, &c);
-         }
-#ifdef	USEAXL
-         if (!er && w->path->callbackxmlraw)
-         {
-            if (websocket_debug)
-               fprintf (stderr, "%p Connect callback\n", w);
-            er = w->path->callbackxmlraw (w, xhead, 0, NULL);
-            xhead = NULL;
-         } else if (!er && w->path->callbackxml)
          {
             if (websocket_debug)
-               fprintf (stderr, "%p Connect callback\n", w);
-            er = w->path->callbackxml (w, xhead, NULL);
-            xhead = NULL;
+               fprintf (stderr, "Could not establish SSL client connection\n");
+            websocket_ev_close (w);
          }
-#endif
-#ifdef	USEAJL
-         if (!er && w->path->callbackjsonraw)
-         {
-            if (websocket_debug)
-               fprintf (stderr, "%p Connect callback\n", w);
-            er = w->path->callbackjsonraw (w, jhead, 0, NULL);
-            jhead = NULL;       // assumed consumed
-         } else if (!er && w->path->callbackjson)
+         return;
+      }
+      w->sslok = 1;
+      websocket_ev_want (w, 0);
+   }
+   if (!w->connected)
+   {                            // Rx initial handshake
+      while (!websocket_ev_request (w))
+      {
+         if (w->txres)
+            return;             // Sending 100 Continue, reads again once sent
+         if (w->rxlen - w->rxptr < 1000)
          {
-            if (websocket_debug)
-               fprintf (stderr, "%p Connect callback\n", w);
-            er = w->path->callbackjson (w, jhead, NULL);
-            jhead = NULL;       // assumed consumed
-         }
-#endif
-         if (!er)
-         {                      // Response...
-            txb_t *txb = malloc (sizeof (*txb));
-            memset (txb, 0, sizeof (*txb));
-            pthread_mutex_init (&txb->mutex, NULL);
-            txb->count = 1;
-            txb->len = asprintf ((char **) &txb->buf,   //
-                                 "HTTP/1.1 101 Switching Protocols\r\n" //
-                                 "Upgrade: websocket\r\n"       //
-                                 "Connection: Upgrade\r\n"      //
-                                 "Set-Cookie: %s=%s; Path=%s; Domain=%s%s\r\n"  //
-                                 "Sec-WebSocket-Accept: %s\r\n" //
-                                 "\r\n",        //
-                                 wscookie, session, path->path ? : url, host, w->ss ? "; Secure" : "",
-#ifdef	USEAXL
-                                 xml_base64 (SHA_DIGEST_LENGTH, hash)
-#else
-#ifdef	USEAJL
-                                 j_base64 (SHA_DIGEST_LENGTH, hash)
-#else
-                                 NULL
-#endif
-#endif
-               );
-            if (txb->len <= 0)
-               er = "Bad asprintf";
-            else
-            {                   // Switch protocols message to front of queue
-               // Like txb_queue, but at start of queue
-               txq_t *txq = malloc (sizeof (*txq));
-               memset (txq, 0, sizeof (*txq));
-               txq->data = txb;
-               pthread_mutex_lock (&txb->mutex);
-               txb->count++;
-               pthread_mutex_unlock (&txb->mutex);
-               pthread_mutex_lock (&w->mutex);
-               if (w->txq)
-                  txq->next = w->txq;
-               else
-                  w->txe = txq;
-               w->txq = txq;
-               w->connected = 1;        // Allows tx to start
-               pthread_mutex_unlock (&w->mutex);
-               char poke = 0;
-               pthread_mutex_lock (&w->mutex);
-               if (w->pipe[1] >= 0)
-                  safe_write (w->pipe[1], &poke, sizeof (poke));
-               pthread_mutex_unlock (&w->mutex);
-               txb_done (txb);
+            unsigned char *n = realloc (w->rxdata, w->rxlen + 1000);
+            if (!n)
+            {
+               websocket_ev_fail (w, "Malloc fail");
+               return;
             }
+            w->rxdata = n;
+            w->rxlen += 1000;
+         }
+         ssize_t len = websocket_read (w, w->rxdata + w->rxptr, w->rxlen - w->rxptr - 1);
+         if (len < 0 && errno == EAGAIN)
+            return;             // Wait for more
+         if (!len && w->rxep && w->rxwant == SIZE_MAX)
+            w->rxeof = 1;       // Body ends with connection close
+         else if (len <= 0)
+         {
+            websocket_ev_fail (w, "Connection closed in handshake");
+            return;
          }
+         w->rxptr += len;
       }
-#ifdef	USEAXL
-      if (xhead)
-         xml_tree_delete (xhead);
+      if (!w->connected)
+         return;                // Failed
+   }
+   while (!w->dead && !w->throttled)
+   {                            // Rx websocket packets
+      w->rxget = w->rxput = 0;
+      ssize_t len = websocket_read (w, w->rxbuf, RXBUF);
+      if (len < 0 && errno == EAGAIN)
+         return;                // Wait for more
+      if (len <= 0)
+      {
+         websocket_ev_close (w);
+         return;
+      }
+      w->rxput = len;
+      char *e = websocket_rx_frames (w);
+      if (e)
+      {
+         websocket_ev_fail (w, e);
+         return;
+      }
+      if (!w->ss && len < RXBUF && !w->throttled)
+         return;                // Short read, nothing more waiting
+   }
+   if (w->throttled && !w->dead)
+      websocket_ev_want (w, w->events & EPOLLOUT);      // Wait for callback workers
+}
+
+#ifdef	USEURING
+static void
+websocket_ur_recv (websocket_t * w)
+{                               // Start multishot receive in to provided buffers (io_uring)
+   struct io_uring_sqe *sqe = websocket_ur_sqe (w->reactor, (void *) ((uintptr_t) w | 2));
+   io_uring_prep_recv_multishot (sqe, w->socket, NULL, 0, 0);
+   sqe->flags |= IOSQE_BUFFER_SELECT;
+   sqe->buf_group = 0;
+   w->inflight++;
+   w->recving = 1;
+}
+
+static void
+websocket_ur_accept (websocket_reactor_t * r, websocket_listener_t * l)
+{                               // Start multishot accept (io_uring)
+   struct io_uring_sqe *sqe = websocket_ur_sqe (r, (void *) ((uintptr_t) l | 1));
+   io_uring_prep_multishot_accept (sqe, l->socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+static void
+websocket_ur_arm (websocket_reactor_t * r)
+{                               // Start accepting on any newly bound listening sockets (io_uring)
+   pthread_mutex_lock (&r->mutex);
+   websocket_listener_t **arm = r->arm;
+   int n = r->narm;
+   r->arm = NULL;
+   r->narm = 0;
+   pthread_mutex_unlock (&r->mutex);
+   while (n--)
+      websocket_ur_accept (r, arm[n]);
+   free (arm);
+}
 #endif
-#ifdef	USEAJL
-      j_delete (&jhead);
+
+static void
+websocket_ev_add (websocket_reactor_t * r, websocket_bind_t * b, int s, struct sockaddr_in6 *addr)
+{                               // Add accepted connection to reactor (event engine)
+   websocket_t *w = websocket_new (b, s, addr, r);
+   if (!w)
+      return;
+   w->when = time (0) + 10;     // Handshake timeout
+   char *e = NULL;
+   if (b->keyfile && !(e = websocket_ssl (w)))
+      SSL_set_mode (w->ss, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef	USEURING
+   if (!e && r->uring && !w->ss && !(w->txmsg = malloc (sizeof (struct msghdr) + TXIOV * sizeof (struct iovec))))
+      e = "Malloc fail";
+   if (!e && w->txmsg)
+   {                            // SSL sockets stay on epoll, as SSL does its own reads and writes
+      w->uring = 1;
+      websocket_ur_recv (w);
+   }
 #endif
-      free (session);
-      if (er)
-         return er;             // Error
+   struct epoll_event ev = { EPOLLIN, {.ptr = w} };
+   w->events = ev.events;
+   if (!e && !w->uring && epoll_ctl (r->epoll, EPOLL_CTL_ADD, s, &ev))
+      e = "Cannot add to epoll";
+   if (e)
+   {
+      if (websocket_debug)
+         fprintf (stderr, "%s\n", e);
+      if (w->ss)
+         SSL_free (w->ss);
+      close (s);
+#ifdef	USEURING
+      free (w->txmsg);
+#endif
+      pool_free (&pools[POOL_WS], w);
+      return;
    }
+   // Link in
+   w->rnext = r->sessions;
+   if (w->rnext)
+      w->rnext->rprev = w;
+   r->sessions = w;
+   pthread_mutex_lock (&b->mutex);
+   w->next = b->sessions;
+   b->sessions = w;
+   pthread_mutex_unlock (&b->mutex);
+}
 
-   w->rxptr = 0;                // next packet
-   w->rxlen = 0;
-   if (w->rxdata)
-      free (w->rxdata);
-   w->rxdata = NULL;
-   {                            // Rx websocket packets
-      while (1)
+static void
+websocket_ev_accept (websocket_reactor_t * r, websocket_listener_t * l)
+{                               // Accept new connections (event engine)
+   int n = 64;                  // Limit so other reactors get a look in
+   while (n--)
+   {
+      struct sockaddr_in6 addr = { 0 };
+      socklen_t len = sizeof (addr);
+      int s = accept4 (l->socket, (void *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (s < 0)
       {
-         unsigned char head[14],
-           hptr = 0,
-            hlen = 2;
-         ssize_t len = 0;
-         while (hptr < hlen)
-         {
-            if (w->ss)
-               len = SSL_read (w->ss, head + hptr, hlen - hptr);
-            else
-               len = recv (w->socket, head + hptr, hlen - hptr, 0);
-            if (len <= 0)
-               return NULL;     // closed
-            hptr += len;
-            if (hptr == 2)
-            {                   // Work out header length
-               if (head[1] & 0x80)
-                  hlen += 4;    // mask
-               int l = (head[1] & 0x7F);
-               if (l == 126)
-                  hlen += 2;    // len
-               else if (l == 127)
-                  hlen += 8;    // len
-            }
-         }
+         if (errno == ECONNABORTED || errno == EINTR)
+            continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            warn ("Bad accept");
+         return;
+      }
+      websocket_ev_add (r, l->bind, s, &addr);
+   }
+}
+
+static void
+websocket_ev_sweep (websocket_reactor_t * r)
+{                               // Handshake timeouts and pings (event engine)
+   time_t now = time (0);
+   websocket_t *w,
+    *n;
+   for (w = r->sessions; w; w = n)
+   {
+      n = w->rnext;
+      if (w->connected && !w->throttled)
+         websocket_rx_idle (w);
+      if (now < w->when)
+         continue;
+      if (!w->connected)
+      {                         // Handshake (or response) taking too long
          if (websocket_debug)
+            fprintf (stderr, "Handshake timeout\n");
+         websocket_ev_close (w);
+         continue;
+      }
+      w->when = now + 60;
+      if (!atomic_load (&w->txn))
+      {                         // Send Ping
+         txb_t *txb = txb_new_ping ();
+         if (txb)
          {
-            fprintf (stderr, "Rx Header");
-            for (hptr = 0; hptr < hlen; hptr++)
-               fprintf (stderr, " %02X", head[hptr]);
-            fprintf (stderr, "\n");
-         }
-         len = (head[1] & 0x7F);
-         if (len == 126)
-            len = (head[2] << 8) + (head[3]);
-         else if (len == 127)
-            len =
-               ((unsigned long long) head[2] << 56) + ((unsigned long long) head[3] << 48) + ((unsigned long long) head[4] << 40) +
-               ((unsigned long long) head[5] << 32) + ((unsigned long long) head[6] << 24) + ((unsigned long long) head[7] << 16) +
-               ((unsigned long long) head[8] << 8) + ((unsigned long long) head[9]);
-         w->rxdata = realloc (w->rxdata, (w->rxlen += len) + 1);
-         while (w->rxptr < w->rxlen)
-         {
-            if (w->ss)
-               len = SSL_read (w->ss, w->rxdata + w->rxptr, w->rxlen - w->rxptr);
-            else
-               len = recv (w->socket, w->rxdata + w->rxptr, w->rxlen - w->rxptr, 0);
-            if (len <= 0)
-               return NULL;     // closed
-            size_t p = w->rxptr;
-            w->rxptr += len;
-            if (head[1] & 0x80)
-            {                   // Mask
-               int q = 0;
-               while (p < w->rxptr)
-               {
-                  w->rxdata[p] ^= head[hlen - 4 + q];
-                  q = ((q + 1) & 3);
-                  p++;
-               }
-            }
+            txb_control (w, txb);       // Skipped if cannot
+            txb_done (txb);
          }
-         if (head[0] & 0x80)
-         {                      // End of data
-            if (!(head[1] & 0x80))
-               return "Unmasked data";
-            if (websocket_debug)
-            {
-               fprintf (stderr, "Rx");
-               if ((head[0] & 0x0F) == 1)
-                  fprintf (stderr, " [%.*s]", (int) w->rxlen, w->rxdata);       // Text frame
-               else
-               {
-                  unsigned int p;
-                  for (p = 0; p < w->rxlen; p++)
-                     fprintf (stderr, " %02X", w->rxdata[p]);   // Binary data
-               }
-               fprintf (stderr, "\n");
-            }
-            w->rxdata[w->rxlen] = 0;    // Always add a NULL for safety
-            if ((head[0] & 0xF) == 1 || (head[0] & 0xF) == 2)
-            {                   // data
-#ifdef	USEAXL
-               if (w->path && w->path->callbackxmlraw)
-               {                // Raw callback
-                  if (websocket_debug)
-                     fprintf (stderr, "%p Data callback\n", w);
-                  char *e = w->path->callbackxmlraw (w, NULL, w->rxptr, w->rxdata);
-                  w->rxdata = NULL;     // Consumed
-                  w->rxptr = 0;
-                  if (e)
-                     return e;  // bad
-               } else if (w->path && w->path->callbackxml)
-               {                // JSON callback
-                  xml_t xml = xml_tree_parse_json ((char *) w->rxdata, "json");
-                  if (!xml)
-                     return "Bad XML";
-                  if (websocket_debug)
-                     fprintf (stderr, "%p Data callback\n", w);
-                  char *e = w->path->callbackxml (w, NULL, xml);        // XML is consumed
-                  if (e)
-                     return e;  // bad
-               }
+      }
+   }
+}
+
+static void
+websocket_ev_resume (websocket_t * w)
+{                               // Read again if was waiting for callback workers (event engine)
+   if (!w->throttled || w->dead || websocket_work_full (w))
+      return;
+   w->throttled = 0;
+#ifdef	USEURING
+   if (w->uring && !w->recving)
+      websocket_ur_recv (w);
 #endif
-#ifdef	USEAJL
-               if (w->path && w->path->callbackjsonraw)
-               {                // Raw callback
-                  if (websocket_debug)
-                     fprintf (stderr, "%p Data callback\n", w);
-                  char *e = w->path->callbackjsonraw (w, NULL, w->rxptr, w->rxdata);
-                  w->rxdata = NULL;     // Consumed
-                  w->rxptr = 0;
-                  if (e)
-                     return e;  // bad
-               } else if (w->path && w->path->callbackjson)
-               {                // JSON callback
-                  j_t json = j_create ();
-                  char *e = j_read_mem (json, (char *) w->rxdata, -1);
-                  if (e)
-                  {
-                     j_delete (&json);
-                     return e;  // bad
-                  }
-                  if (websocket_debug)
-                     fprintf (stderr, "%p Data callback\n", w);
-                  e = w->path->callbackjson (w, NULL, json);    // JSON is consumed
-                  if (e)
-                     return e;  // bad
-               }
+   websocket_ev_want (w, w->events & EPOLLOUT);
+   if (w->ss)
+      websocket_ev_rx (w);      // SSL may have data buffered already
+}
+
+static void
+websocket_ev_events (websocket_reactor_t * r, struct epoll_event *ev, int n)
+{                               // Handle epoll events (event engine)
+   int i;
+   for (i = 0; i < n; i++)
+   {
+      uintptr_t d = (uintptr_t) ev[i].data.ptr;
+      if (!d)
+      {                         // Kicked, tx to do
+         eventfd_t v;
+         eventfd_read (r->event, &v);
+#ifdef	USEURING
+         if (r->narm)
+            websocket_ur_arm (r);
 #endif
-            } else if ((head[0] & 0xF) == 8)
-            {                   // Close
-               return NULL;
-            } else if ((head[0] & 0xF) == 9)
-            {                   // Ping
-               head[0] = 0x8A;  // Send Pong
-               if (head[1] & 0x80)
-               {                // Reply is not masked
-                  head[1] &= ~0x80;
-                  hlen -= 4;
-               }
-               // Again, not quote txb_queue as we have the data
-               txb_t *txb = malloc (sizeof (*txb));
-               memset (txb, 0, sizeof (*txb));
-               pthread_mutex_init (&txb->mutex, NULL);
-               txb->count = 1;
-               txb->len = w->rxlen;
-               txb->buf = w->rxdata;
-               memmove (txb->head, head, txb->hlen = hlen);
-               w->rxdata = NULL;        // Used in this buffer
-               txq_t *txq = malloc (sizeof (*txq));
-               memset (txq, 0, sizeof (*txq));
-               txq->data = txb;
-               pthread_mutex_lock (&w->mutex);
-               if (w->txq)
-                  w->txe->next = txq;
-               else
-                  w->txq = txq;
-               w->txe = txq;
-               pthread_mutex_unlock (&w->mutex);
-            } else if ((head[0] & 0xF) == 0xA)
-            {                   // Pong
-               struct timeval tv;
-               struct timezone tz;
-               gettimeofday (&tv, &tz);
-               unsigned long long pong = tv.tv_sec * 1000000ULL + tv.tv_usec;;
-               unsigned long long ping = 0;
-               if (w->rxlen == sizeof (ping))
-               {
-                  memcpy (&ping, w->rxdata, sizeof (ping));
-                  w->ping = pong - ping;
-                  if (websocket_debug)
-                     fprintf (stderr, "Pong %lluus\n", pong - ping);
-               }
-            }
-            w->rxptr = 0;       // next packet
-            w->rxlen = 0;
-            if (w->rxdata)
+         int c = 1024;          // Limit so rx gets a look in
+         while (c--)
+         {
+            pthread_mutex_lock (&r->mutex);
+            websocket_t *w = r->kick;
+            if (w)
             {
-               free (w->rxdata);
-               w->rxdata = NULL;
+               r->kick = w->knext;
+               w->kicked = 0;
             }
+            pthread_mutex_unlock (&r->mutex);
+            if (!w)
+               break;
+            websocket_ev_resume (w);
+            websocket_ev_tx (w);
+         }
+         if (c < 0)
+            eventfd_write (r->event, 1);        // More to do
+      } else if (d & 1)
+         websocket_ev_accept (r, (websocket_listener_t *) (d - 1));
+      else
+      {                         // Socket
+         websocket_t *w = (void *) d;
+         if (w->zcq && !w->dead && (ev[i].events & EPOLLERR) && websocket_zc_done (w))
+            ev[i].events &= ~EPOLLERR;  // Was zero copy sends done
+         if ((ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) || (w->ss && (ev[i].events & EPOLLOUT)))
+            websocket_ev_rx (w);
+         if (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+         {
+            unsigned char cont = w->txcont;
+            websocket_ev_tx (w);
+            if (cont && !w->txcont)
+               websocket_ev_rx (w);     // Sent 100 Continue, there may be body waiting (e.g. in SSL)
          }
       }
    }
+}
 
-   return NULL;
+#ifdef	USEURING
+static void
+websocket_ur_poll (websocket_reactor_t * r)
+{                               // Poll the epoll fd (io_uring), for SSL sockets and kicks
+   struct io_uring_sqe *sqe = websocket_ur_sqe (r, NULL);
+   io_uring_prep_poll_multishot (sqe, r->epoll, POLLIN);
 }
 
-void *
-websocket_rx (void *p)
-{                               // Rx thread
-   sigignore (SIGPIPE);
-   websocket_t *w = p;
-   char *e = websocket_do_rx (w);
-   if (e && websocket_debug)
-      fprintf (stderr, "Rx socket response: %s\n", e);
+static void
+websocket_ur_rx (websocket_t * w, unsigned char *buf, size_t len)
+{                               // Received data (io_uring), len 0 if closed
+   if (w->dead || (w->txres && !w->txcont))
+      return;
    if (!w->connected)
-   {                            // Error...
-      char *res = NULL;
-      size_t len = 0;
-      if (*e == '@')
-      {                         // Send a file!
-         FILE *o = open_memstream (&res, &len);
-         FILE *i = fopen (e + 1, "r");
-         if (i)
-         {
-            fprintf (o, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Type: ");
-            char *p = strrchr (e + 1, '.') ? : ".plain";
-            if (!strcasecmp (p, ".png"))
-               fprintf (o, "image/png");
-            else if (!strcasecmp (p, ".svg"))
-               fprintf (o, "image/svg+xml");
-            else if (!strcasecmp (p, ".js"))
-               fprintf (o, "text/javascript");
-            else
-               fprintf (o, "text/%s", p + 1);
-            fprintf (o, "\r\n\r\n");
-            while (1)
-            {
-               char buf[10240];
-               size_t l = fread (buf, 1, sizeof (buf), i);
-               if (l <= 0)
-                  break;
-               fwrite (buf, l, 1, o);
-            }
-            fclose (i);
-         } else
-            fprintf (o, "HTTP/1.1 404 Not found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot found");
-         fclose (o);
-      } else if (*e == '>')
-         len = asprintf (&res, "HTTP/1.1 302 Moved\r\nLocation: %s\r\nConnection: close\r\n\r\n", e + 1);       // Redirect
-      else if (*e == '*')
-         len = asprintf (&res, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s", e + 1);    // General data
-      else if (!strncmp (e, "204 ", 4))
-         len = asprintf (&res, "HTTP/1.1 %s\r\nConnection: close\r\n\r\n", e);  // No content
-      else if (!strncmp (e, "401 ", 4))
-         len = asprintf (&res, "HTTP/1.1 401 Unauthorised\r\nWWW-Authenticate: Basic realm=\"%s\"\r\nConnection: close\r\n\r\nLogin required", e + 4);  // No content
-      else if (isdigit (e[0]) && isdigit (e[1]) && isdigit (e[2]) && e[3] == ' ')       // Error message
-         len = asprintf (&res, "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s", e, e + 4);
-      else
-         len = asprintf (&res, "HTTP/1.1 500 %s\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n%s", e, e);     // General error
-      if (len > 0)
+   {                            // Rx initial handshake, kept while sending 100 Continue
+      if (!len && w->rxep && w->rxwant == SIZE_MAX)
+         w->rxeof = 1;          // Body ends with connection close
+      else if (!len)
       {
-         size_t ptr = 0;
-         while (ptr < len)
+         websocket_ev_fail (w, "Connection closed in handshake");
+         return;
+      }
+      if (w->rxlen - w->rxptr < len + 1)
+      {
+         unsigned char *n = realloc (w->rxdata, w->rxptr + len + 1000);
+         if (!n)
          {
-            size_t sent = 0;
-            if (w->ss)
-               sent = SSL_write (w->ss, res + ptr, len - ptr);
-            else
-               sent = send (w->socket, res + ptr, len - ptr, 0);
-            if (sent <= 0)
-               break;
-            ptr += sent;
+            websocket_ev_fail (w, "Malloc fail");
+            return;
          }
+         w->rxdata = n;
+         w->rxlen = w->rxptr + len + 1000;
       }
-      free (res);
+      memcpy (w->rxdata + w->rxptr, buf, len);
+      w->rxptr += len;
+      if (!w->txres)
+         websocket_ev_request (w);      // Else once the 100 Continue is sent
+   } else if (!len)
+   {
+      websocket_ev_close (w);
+      return;
+   } else
+   {
+      w->rxbuf = buf;           // Process in place
+      w->rxget = 0;
+      w->rxput = len;
+      char *e = websocket_rx_frames (w);
+      w->rxbuf = NULL;
+      if (e)
+         websocket_ev_fail (w, e);
    }
-   if (e && (*e == '*' || *e == '@' || *e == '>'))
-      free (e);                 // Malloc'd
-   pthread_mutex_lock (&w->mutex);
-   if (w->pipe[1] >= 0)
-      close (w->pipe[1]);       // stop tx
-   w->pipe[1] = -1;
-   pthread_mutex_unlock (&w->mutex);
-   if (w->rxdata)
-      free (w->rxdata);
-   pthread_exit (NULL);
-   return NULL;
+   if (w->throttled && w->recving && !w->dead)
+   {                            // Stop receiving until callback workers catch up
+      struct io_uring_sqe *sqe = websocket_ur_sqe (w->reactor, (void *) 1);     // Result ignored
+      io_uring_prep_cancel (sqe, (void *) ((uintptr_t) w | 2), 0);
+   }
+}
+
+static void
+websocket_ur_cqe (websocket_reactor_t * r, struct io_uring_cqe *cqe)
+{                               // Handle a completion (io_uring)
+   uintptr_t d = (uintptr_t) io_uring_cqe_get_data (cqe);
+   int more = (cqe->flags & IORING_CQE_F_MORE);
+   if (!d)
+   {                            // epoll has events
+      struct epoll_event ev[64];
+      int n;
+      do
+         websocket_ev_events (r, ev, n = epoll_wait (r->epoll, ev, sizeof (ev) / sizeof (*ev), 0));
+      while (n == sizeof (ev) / sizeof (*ev));
+      if (!more)
+         websocket_ur_poll (r);
+      return;
+   }
+   if (d == 1)
+      return;                   // Cancel done
+   if ((d & 3) == 1)
+   {                            // Accept
+      websocket_listener_t *l = (void *) (d - 1);
+      if (cqe->res >= 0)
+      {
+         struct sockaddr_in6 addr = { 0 };
+         socklen_t len = sizeof (addr);
+         getpeername (cqe->res, (void *) &addr, &len);
+         websocket_ev_add (r, l->bind, cqe->res, &addr);
+      } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR && cqe->res != -EAGAIN)
+         warnx ("Bad accept: %s", strerror (-cqe->res));
+      if (!more)
+         websocket_ur_accept (r, l);
+      return;
+   }
+   websocket_t *w = (void *) (d & ~(uintptr_t) 3);
+   if (!more)
+      w->inflight--;
+   if ((d & 3) == 2)
+   {                            // Recv
+      if (!more)
+         w->recving = 0;
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+      {
+         int bid = (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+         unsigned char *buf = r->bufs + bid * RXBUF;
+         if (cqe->res > 0)
+            websocket_ur_rx (w, buf, cqe->res);
+         io_uring_buf_ring_add (r->br, buf, RXBUF, bid, io_uring_buf_ring_mask (URBUFS), 0);
+         io_uring_buf_ring_advance (r->br, 1);
+      } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+         websocket_ur_rx (w, NULL, 0);  // Closed or error
+      if (!more && !w->dead && !w->throttled && (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED))
+         websocket_ur_recv (w); // Carry on
+      return;
+   }
+   // Send
+   w->txsends--;
+   if (cqe->res > 0)
+      websocket_sent (w, cqe->res);
+   else if (cqe->res < 0)
+      w->txfail = 1;
+   if (!w->txsends)
+   {
+      unsigned char cont = w->txcont;
+      websocket_ur_tx (w);      // Next, or rest after short send, or close
+      if (cont && !w->txcont && !w->dead)
+         websocket_ev_request (w);      // Sent 100 Continue, check what arrived meanwhile
+   }
+}
+
+static void
+websocket_ur_wait (websocket_reactor_t * r)
+{                               // Submit and wait for completions (io_uring)
+   struct __kernel_timespec ts = { 1, 0 };
+   struct io_uring_cqe *cqe;
+   int e = io_uring_submit_and_wait_timeout (&r->ring, &cqe, 1, &ts, NULL);
+   if (e < 0 && e != -ETIME && e != -EINTR)
+      warnx ("io_uring: %s", strerror (-e));
+   unsigned head,
+     n = 0;
+   io_uring_for_each_cqe (&r->ring, head, cqe)
+   {
+      websocket_ur_cqe (r, cqe);
+      n++;
+   }
+   io_uring_cq_advance (&r->ring, n);
 }
+#endif
 
 void *
-websocket_listen (void *p)
-{                               // Listen thread
+websocket_reactor (void *p)
+{                               // Event engine thread
    sigignore (SIGPIPE);
-   websocket_bind_t *b = p;
+   websocket_reactor_t *r = p;
+   time_t sweep = time (0);
+#ifdef	USEURING
+   if (r->uring)
+      websocket_ur_poll (r);
+#endif
    while (1)
    {
-      struct sockaddr_in6 addr = { 0 };
-      socklen_t len = sizeof (addr);
-      int s = accept (b->socket, (void *) &addr, &len);
-      if (s < 0)
-      {
-         warn ("Bad accept");
-         continue;
-      }
-      char from[INET6_ADDRSTRLEN + 1] = "";
-      if (addr.sin6_family == AF_INET)
-         inet_ntop (addr.sin6_family, &((struct sockaddr_in *) &addr)->sin_addr, from, sizeof (from));
+#ifdef	USEURING
+      if (r->uring)
+         websocket_ur_wait (r);
       else
-         inet_ntop (addr.sin6_family, &addr.sin6_addr, from, sizeof (from));
-      if (!strncmp (from, "::ffff:", 7) && strchr (from, '.'))
-         memmove (from, from + 7, strlen (from + 7) + 1);
-      if (websocket_debug)
-         fprintf (stderr, "Accepted connection from %s\n", from);
-      websocket_t *w = malloc (sizeof (*w));
-      if (!w)
+#endif
       {
-         warnx ("Malloc fail");
-         close (s);
-         continue;
-      }
-      memset (w, 0, sizeof (*w));
-      pthread_mutex_init (&w->mutex, NULL);
-      w->bind = b;
-      w->socket = s;
-      w->from = strdup (from);
-      if (pipe ((int *) w->pipe))
-      {                         // Failed to make pipe even, that is bad
-         if (websocket_debug)
-            fprintf (stderr, "Cannot make pipe\n");
-         free (w);
-         close (s);
-         continue;
+         struct epoll_event ev[64];
+         int n = epoll_wait (r->epoll, ev, sizeof (ev) / sizeof (*ev), 1000);
+         if (n < 0 && errno != EINTR)
+            warn ("epoll");
+         websocket_ev_events (r, ev, n);
       }
-      // Link in
-      pthread_mutex_lock (&b->mutex);
-      w->next = b->sessions;
-      b->sessions = w;
-      pthread_mutex_unlock (&b->mutex);
-      // Threads (tx cleans up, so started last)
-      pthread_t t;
-      if (pthread_create (&t, NULL, websocket_rx, w))
-      {                         // No rx task, close things and free
-         if (websocket_debug)
-            fprintf (stderr, "Cannot make rx thread\n");
-         pthread_mutex_lock (&w->mutex);
-         close (w->pipe[1]);    // Tells tx thread to give up and close/free
-         w->pipe[1] = -1;
-         pthread_mutex_unlock (&w->mutex);
-         close (s);
-         continue;
+      time_t now = time (0);
+      if (now != sweep)
+      {
+         sweep = now;
+         websocket_ev_sweep (r);
       }
-      pthread_detach (t);
-      if (pthread_create (&t, NULL, websocket_tx, w))
-      {                         // Failed to make tx thread
-         if (websocket_debug)
-            fprintf (stderr, "Cannot make tx thread\n");
-         pthread_mutex_lock (&w->mutex);
-         close (w->pipe[0]);
-         w->pipe[0] = -1;
-         close (w->pipe[1]);
-         w->pipe[1] = -1;
-         pthread_mutex_unlock (&w->mutex);
-         free (w);              // Problematic if rx task running.
-         continue;
+      websocket_t *keep = NULL;
+      while (r->dead)
+      {                         // Free closed sockets, nothing else in this pass can reference them now
+         websocket_t *w = r->dead;
+         r->dead = w->rnext;
+#ifdef	USEURING
+         if (w->inflight)
+         {                      // Wait for io_uring operations to complete
+            w->rnext = keep;
+            keep = w;
+            continue;
+         }
+         if (w->uring)
+            close (w->socket);
+#endif
+         websocket_end (w);
       }
-      pthread_detach (t);
+      r->dead = keep;
+   }
+   return NULL;
+}
+
+#ifdef	USEURING
+static int
+websocket_ur_init (websocket_reactor_t * r)
+{                               // Set up io_uring for a reactor, 0 if OK
+   if (io_uring_queue_init (URENTRIES, &r->ring, 0))
+      return -1;
+   int e = 0;
+   r->br = io_uring_setup_buf_ring (&r->ring, URBUFS, 0, 0, &e);
+   r->bufs = malloc (URBUFS * RXBUF);
+   if (!r->br || !r->bufs)
+   {
+      free (r->bufs);
+      r->bufs = NULL;
+      io_uring_queue_exit (&r->ring);
+      return -1;
+   }
+   int b;
+   for (b = 0; b < URBUFS; b++)
+      io_uring_buf_ring_add (r->br, r->bufs + b * RXBUF, RXBUF, b, io_uring_buf_ring_mask (URBUFS), b);
+   io_uring_buf_ring_advance (r->br, URBUFS);
+   r->uring = 1;
+   return 0;
+}
+#endif
+
+static const char *
+websocket_reactor_start (int n, int uring)
+{                               // Start event engine threads (once)
+   if (reactors)
+      return NULL;
+#ifndef	USEURING
+   if (uring)
+      return "Not built with io_uring (USEURING)";
+#endif
+   websocket_reactor_t *rs = calloc (n, sizeof (*rs));
+   if (!rs)
+      return "Malloc fail";
+   int i;
+   for (i = 0; i < n; i++)
+   {
+      websocket_reactor_t *r = &rs[i];
+      pthread_mutex_init (&r->mutex, NULL);
+      r->epoll = epoll_create1 (EPOLL_CLOEXEC);
+      if (r->epoll < 0)
+         return "Cannot create epoll";
+      r->event = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (r->event < 0)
+         return "Cannot create eventfd";
+      struct epoll_event ev = { EPOLLIN, {.ptr = NULL} };
+      if (epoll_ctl (r->epoll, EPOLL_CTL_ADD, r->event, &ev))
+         return "Cannot add eventfd to epoll";
+#ifdef	USEURING
+      if (uring && websocket_ur_init (r) && websocket_debug)
+         fprintf (stderr, "io_uring not available, using epoll\n");
+#endif
+      if (pthread_create (&r->thread, NULL, websocket_reactor, r))
+         return "Thread create error";
+      pthread_detach (r->thread);
    }
+   reactors = rs;
+   nreactors = n;
    return NULL;
 }
 
@@ -1435,7 +5555,9 @@ websocket_bind_opts (websocket_bindopts_t o)
       if (!binds)
          SSL_library_init ();
       // bind
-      int s = -1;
+      int listeners = o.listeners ? : 1,
+         backlog = o.backlog ? : 10;
+      int *s = alloca (listeners * sizeof (*s));
       {                         // bind
          char *port = strdupa (o.port);
          char *host = NULL;
@@ -1457,53 +5579,69 @@ websocket_bind_opts (websocket_bindopts_t o)
          if (!res)
             return "Cannot find port";
          const char *err = NULL;
-         for (r = res; r && r->ai_family != AF_INET6; r = r->ai_next);
-         if (!r)
-            r = res;
-         for (; r; r = r->ai_next)
+         int mksocket (void)
          {
-            s = socket (r->ai_family, r->ai_socktype, r->ai_protocol);
+            int s = socket (r->ai_family, r->ai_socktype | SOCK_CLOEXEC, r->ai_protocol);
             if (s < 0)
             {
                err = "Cannot create socket";
-               continue;
+               return -1;
             }
             int on = 1;
             if (setsockopt (s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)))
             {
                close (s);
                err = "Failed to set socket option (REUSE)";
-               continue;
+               return -1;
+            }
+            if (listeners > 1 && setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)))
+            {                   // Kernel spreads connections over the listening sockets
+               close (s);
+               err = "Failed to set socket option (REUSEPORT)";
+               return -1;
             }
             int max = MAXTCP;
             if (setsockopt (s, SOL_SOCKET, SO_RCVBUF, &max, sizeof (max)))
             {
                close (s);
                err = "Failed to set socket option (RCV)";
-               continue;
+               return -1;
             }
             if (setsockopt (s, SOL_SOCKET, SO_SNDBUF, &max, sizeof (max)))
             {
                close (s);
                err = "Failed to set socket option (SND)";
-               continue;
+               return -1;
             }
             if (bind (s, r->ai_addr, r->ai_addrlen))
             {
                close (s);
                err = "Failed to bind to address";
-               continue;
+               return -1;
             }
-            if (listen (s, 10))
+            if (listen (s, backlog))
             {
                close (s);
                err = "Could not listen on port";
-               continue;
+               return -1;
             }
             // Worked
             err = NULL;
-            break;
+            return s;
          }
+         for (r = res; r && r->ai_family != AF_INET6; r = r->ai_next);
+         if (!r)
+            r = res;
+         for (; r; r = r->ai_next)
+            if ((s[0] = mksocket ()) >= 0)
+               break;
+         int n;
+         for (n = 1; !err && n < listeners; n++)
+            s[n] = mksocket (); // Same address
+         if (err)
+            while (--n >= 0)
+               if (s[n] >= 0)
+                  close (s[n]);
          freeaddrinfo (res);
          if (err)
             return err;
@@ -1517,19 +5655,74 @@ websocket_bind_opts (websocket_bindopts_t o)
       if (o.keyfile)
          b->keyfile = strdup (o.keyfile);
       b->port = strdup (o.port);
-      b->socket = s;
+      b->listeners = listeners;
+      b->txbudget = o.txbudget ? : 65536;
+      b->zerocopy = o.zerocopy;
+      if (o.workers)
+      {                         // Callback workers
+         const char *e = websocket_workers_start (o.workers, o.workqueue ? : 100);
+         if (e)
+            return e;
+         b->workers = 1;
+      }
+      b->listener = calloc (listeners, sizeof (*b->listener));
+      int n;
+      for (n = 0; n < listeners; n++)
+      {
+         b->listener[n].bind = b;
+         b->listener[n].socket = s[n];
+      }
       if (o.keyfile)
       {
          b->ctx = SSL_CTX_new (SSLv23_server_method ());        // Negotiates TLS
          if (!b->ctx)
             return "Cannot create SSL CTX";
       }
+      if (o.reactors || o.uring)
+      {                         // Event engine
+         const char *e = websocket_reactor_start (o.reactors ? : 1, o.uring);
+         if (e)
+            return e;
+         for (n = 0; n < listeners; n++)
+            fcntl (s[n], F_SETFL, fcntl (s[n], F_GETFL) | O_NONBLOCK);
+         // Every reactor gets at least one listening socket, and every listening socket at least one reactor
+         for (n = 0; n < listeners || n < nreactors; n++)
+         {
+            websocket_listener_t *l = &b->listener[n % listeners];
+            websocket_reactor_t *r = &reactors[n % nreactors];
+#ifdef	USEURING
+            if (r->uring)
+            {                   // Multishot accept, set up by the reactor thread
+               pthread_mutex_lock (&r->mutex);
+               websocket_listener_t **arm = realloc (r->arm, (r->narm + 1) * sizeof (*r->arm));
+               if (arm)
+               {
+                  r->arm = arm;
+                  r->arm[r->narm++] = l;
+               }
+               pthread_mutex_unlock (&r->mutex);
+               if (!arm)
+                  return "Malloc fail";
+               eventfd_write (r->event, 1);
+               continue;
+            }
+#endif
+            struct epoll_event ev = { EPOLLIN | EPOLLEXCLUSIVE, {.ptr = (void *) ((uintptr_t) l | 1)} };
+            if (epoll_ctl (r->epoll, EPOLL_CTL_ADD, l->socket, &ev))
+               return "Cannot add listening socket to epoll";
+         }
+      } else
+      {                         // Threads, one accept thread per listening socket
+         for (n = 0; n < listeners; n++)
+         {
+            pthread_t t;
+            if (pthread_create (&t, NULL, websocket_listen, &b->listener[n]))
+               return "Thread create error";
+            pthread_detach (t);
+         }
+      }
       b->next = binds;
       binds = b;
-      pthread_t t;
-      if (pthread_create (&t, NULL, websocket_listen, b))
-         return "Thread create error";
-      pthread_detach (t);
    } else if (strcmp (b->certfile ? : "", o.certfile ? : "") || strcmp (b->keyfile ? : "", o.keyfile ? : ""))
       return "Mismatched cert file on bind";
    websocket_path_t *p;
@@ -1538,6 +5731,15 @@ websocket_bind_opts (websocket_bindopts_t o)
               || strcmp (p->host ? : "", o.host ? : "")); p = p->next);
    if (p)
       return "Already bound";
+   if (o.deflate && (o.deflate < 1 || o.deflate > 9 || (o.deflatebits && (o.deflatebits < 9 || o.deflatebits > 15))
+                     || (o.deflatemem && (o.deflatemem < 1 || o.deflatemem > 9))))
+      return "Bad deflate settings";
+   if (o.path)
+   {                            // ** only as last segment
+      const char *x = strstr (o.path, "**");
+      if (x && (x[2] || (x > o.path && x[-1] != '/')))
+         return "Bad path (** only as last segment)";
+   }
    p = malloc (sizeof (*p));
    memset (p, 0, sizeof (*p));
    if (o.origin)
@@ -1549,14 +5751,34 @@ websocket_bind_opts (websocket_bindopts_t o)
 #ifdef	USEAXL
    p->callbackxml = o.xml;
    p->callbackxmlraw = o.xmlraw;
+   if (o.xmlraw)
+      p->callbackrxalloc = o.rxalloc;
 #endif
 #ifdef	USEAJL
    p->callbackjson = o.json;
    p->callbackjsonraw = o.jsonraw;
+   if (o.jsonraw)
+      p->callbackrxalloc = o.rxalloc;
 #endif
+   p->callbackfull = o.txfull;
+   p->txmaxbytes = o.txmaxbytes;
+   p->txmaxmsgs = o.txmaxmsgs;
+   p->txpolicy = o.txpolicy;
+   p->callbackrxstream = o.rxstream;
+   p->rxmax = o.rxmax;
+   p->rxidle = o.rxidle;
+   if (o.deflate)
+   {                            // Agree permessage-deflate
+      p->deflate = o.deflate;
+      p->deflatebits = (o.deflatebits ? : 15);
+      p->deflatemem = (o.deflatemem ? : 8);
+      p->deflatetakeover = (o.deflatetakeover ? 1 : 0);
+      p->deflatemin = (o.deflatemin ? : DEFLATEMIN);
+   }
    pthread_mutex_lock (&b->mutex);
    p->next = b->paths;
    b->paths = p;
+   atomic_fetch_add_explicit (&b->pathgen, 1, memory_order_release);    // Router made again on next request
    pthread_mutex_unlock (&b->mutex);
    return NULL;                 // OK
 }
@@ -1565,18 +5787,69 @@ const char *
 websocket_send_opts (websocket_send_t o)
 {
    txb_t *txb = NULL;
-   if (o.data)
+   if (o.stream)
+   {                            // Streamed, made as sent
+      if (o.topic || o.num != 1 || !o.ws || !o.ws[0])
+         return "Stream is to one connection";
+      txs_t *s = malloc (sizeof (*s));
+      if (!s)
+         return "Malloc fail";
+      s->cb = o.stream;
+      s->arg = o.arg;
+      s->fragment = (o.fragment ? : 65536);
+      s->opcode = (o.binary ? 0x02 : 0x01);
+      txb = pool_alloc (&pools[POOL_TXB]);
+      if (!txb)
+      {
+         free (s);
+         return "Malloc fail";
+      }
+      atomic_init (&txb->count, 1);
+      txb->stream = s;
+   } else if (o.data)
+   {
       txb = txb_new_data (o.len, o.data);       // raw
+      if (!txb)
+      {                         // Data is done with, as if sent to nobody
+         if (o.release)
+            o.release (o.arg, o.data);
+         else
+            free ((void *) o.data);
+         return "Malloc fail";
+      }
+      if (o.binary)
+         txb->head[0] = 0x82;   // Binary, one block
+      txb->release = o.release;
+      txb->arg = o.arg;
+   }
 #ifdef	USEAJL
    else if (o.json)
-      txb = txb_new_json (o.json);
+   {
+      if (!(txb = txb_new_json (o.json)))
+         return "Malloc fail";
+   }
 #endif
 #ifdef	USEAXL
    else if (o.xml)
-      txb = txb_new_xml (o.xml);
+   {
+      if (!(txb = txb_new_xml (o.xml)))
+         return "Malloc fail";
+   }
 #endif
-   if (!txb)
-      txb = txb_new_data (0, NULL);     // A close
+   if (!txb && !(txb = txb_new_data (0, NULL)))
+      return "Malloc fail";     // A close
+   if (o.topic)
+   {                            // Subscribers
+      unsigned int hash = str_hash (o.topic);
+      pthread_rwlock_rdlock (&topics[hash % TOPICS].lock);
+      websocket_topic_t *t = topic_find (hash, o.topic);
+      int p;
+      for (p = 0; t && p < t->nsubs; p++)
+         txb_send_key (t->subs[p], txb, o.key);
+      pthread_rwlock_unlock (&topics[hash % TOPICS].lock);
+      txb_done (txb);           // Allows for initial set count to 1
+      return NULL;
+   }
    if (!o.ws && !o.num)
    {                            // All
       websocket_bind_t *b;
@@ -1585,7 +5858,7 @@ websocket_send_opts (websocket_send_t o)
          pthread_mutex_lock (&b->mutex);
          websocket_t *w;
          for (w = (websocket_t *) b->sessions; w; w = (websocket_t *) w->next)
-            txb_queue (w, txb);
+            txb_send_key (w, txb, o.key);
          pthread_mutex_unlock (&b->mutex);
       }
       txb_done (txb);           // Allows for initial set count to 1
@@ -1595,15 +5868,440 @@ websocket_send_opts (websocket_send_t o)
    int p;
    for (p = 0; p < o.num; p++)
       if (o.ws[p])
-         txb_queue (o.ws[p], txb);
+         txb_send_key (o.ws[p], txb, o.key);
    txb_done (txb);              // Allows for initial set count to 1
    return NULL;
 }
 
 #ifdef	MAIN
+static const char *
+websocket_selftest_unmask (void)
+{                               // Check each unmask method against a byte at a time, returns error
+   typedef size_t unmask_t (unsigned char *, const unsigned char *, size_t, uint32_t);
+   struct
+   {
+      const char *name;
+      unmask_t *f;
+   } m[] = {
+      {"words", unmask_words},
+#if defined(__x86_64__) || defined(__i386__)
+      {"sse2", __builtin_cpu_supports ("sse2") ? unmask_sse2 : NULL},
+      {"avx2", __builtin_cpu_supports ("avx2") ? unmask_avx2 : NULL},
+#endif
+      {"unmask", NULL},         // websocket_unmask itself
+   };
+   unsigned char src[400],
+     ref[400],
+     dst[400],
+     mask[4];
+   size_t i,
+     len;
+   unsigned int off,
+     t;
+   int q;
+   for (i = 0; i < sizeof (src); i++)
+      src[i] = random ();
+   for (i = 0; i < sizeof (mask); i++)
+      mask[i] = random ();
+   for (off = 0; off < 32; off++)
+      for (len = 0; len <= 300; len++)
+         for (q = 0; q < 4; q++)
+         {
+            for (i = 0; i < len; i++)
+               ref[i] = src[off + i] ^ mask[(q + i) & 3];
+            for (t = 0; t < sizeof (m) / sizeof (*m); t++)
+            {
+               if (!m[t].f && strcmp (m[t].name, "unmask"))
+                  continue;     // CPU does not have it
+               memset (dst, 0xA5, sizeof (dst));
+               if (m[t].f)
+               {                // Method then bytes for the rest, as websocket_unmask does
+                  unsigned char k[4] = { mask[q], mask[(q + 1) & 3], mask[(q + 2) & 3], mask[(q + 3) & 3] };
+                  uint32_t k4;
+                  memcpy (&k4, k, 4);
+                  size_t n = m[t].f (dst + off, src + off, len, k4);
+                  if (n > len)
+                     return "Unmask did too much";
+                  for (; n < len; n++)
+                     dst[off + n] = src[off + n] ^ k[n & 3];
+               } else if (websocket_unmask (dst + off, src + off, len, mask, q) != (int) ((q + len) & 3))
+                  return "Unmask phase wrong";
+               if (memcmp (dst + off, ref, len))
+               {
+                  fprintf (stderr, "%s: off %u len %zu phase %d\n", m[t].name, off, len, q);
+                  return "Unmask mismatch";
+               }
+               for (i = 0; i < sizeof (dst); i++)
+                  if ((i < off || i >= off + len) && dst[i] != 0xA5)
+                  {
+                     fprintf (stderr, "%s: off %u len %zu phase %d\n", m[t].name, off, len, q);
+                     return "Unmask wrote outside buffer";
+                  }
+            }
+            memcpy (dst, src, sizeof (dst));    // In place
+            websocket_unmask (dst + off, dst + off, len, mask, q);
+            if (memcmp (dst + off, ref, len))
+               return "Unmask in place mismatch";
+         }
+   return NULL;
+}
+
+static const char *
+websocket_selftest_utf8 (void)
+{                               // Check each UTF-8 method against the scalar check, and split at every offset, returns error
+   static const struct
+   {
+      unsigned char len,
+        bad;
+      unsigned char s[4];
+   } seq[] = {
+      {1, 0, {0x41}},
+      {2, 0, {0xC2, 0x80}},
+      {2, 0, {0xDF, 0xBF}},
+      {3, 0, {0xE0, 0xA0, 0x80}},
+      {3, 0, {0xE2, 0x82, 0xAC}},
+      {3, 0, {0xED, 0x9F, 0xBF}},
+      {3, 0, {0xEE, 0x80, 0x80}},
+      {3, 0, {0xEF, 0xBF, 0xBF}},
+      {4, 0, {0xF0, 0x90, 0x80, 0x80}},
+      {4, 0, {0xF0, 0x9D, 0x84, 0x9E}},
+      {4, 0, {0xF4, 0x8F, 0xBF, 0xBF}},
+      {2, 1, {0xC0, 0x80}},     // Overlong
+      {2, 1, {0xC1, 0xBF}},
+      {3, 1, {0xE0, 0x80, 0x80}},
+      {3, 1, {0xE0, 0x9F, 0xBF}},
+      {4, 1, {0xF0, 0x80, 0x80, 0x80}},
+      {4, 1, {0xF0, 0x8F, 0xBF, 0xBF}},
+      {3, 1, {0xED, 0xA0, 0x80}},       // Surrogate
+      {3, 1, {0xED, 0xBF, 0xBF}},
+      {4, 1, {0xF4, 0x90, 0x80, 0x80}}, // Above U+10FFFF
+      {4, 1, {0xF5, 0x80, 0x80, 0x80}},
+      {1, 1, {0xFF}},
+      {1, 1, {0x80}},           // Continuation with no lead
+      {1, 1, {0xC3}},           // Truncated
+      {2, 1, {0xE2, 0x82}},
+      {3, 1, {0xF0, 0x9D, 0x84}},
+      {2, 1, {0xC3, 0x41}},
+      {3, 1, {0xE2, 0x82, 0x41}},
+      {4, 1, {0xF0, 0x9D, 0x41, 0x9E}},
+   };
+   static const struct
+   {
+      unsigned char len;
+      unsigned char s[4];
+   } fill[] = {
+      {1, {0x61}},
+      {2, {0xC3, 0xA9}},
+      {3, {0xE2, 0x82, 0xAC}},
+      {4, {0xF0, 0x9F, 0x98, 0x80}},
+   };
+   unsigned char buf[200];
+   unsigned int q,
+     f,
+     n,
+     a;
+   size_t len,
+     k;
+   for (q = 0; q < sizeof (seq) / sizeof (*seq); q++)
+      for (f = 0; f < sizeof (fill) / sizeof (*fill); f++)
+         for (n = 0; n <= 40; n++)
+            for (a = 0; a <= 3; a++)
+            {                   // n fillers, the sequence, then a fillers, so it lands at every lane and block edge
+               len = 0;
+               for (k = 0; k < n; k++)
+                  for (unsigned int i = 0; i < fill[f].len; i++)
+                     buf[len++] = fill[f].s[i];
+               memcpy (buf + len, seq[q].s, seq[q].len);
+               len += seq[q].len;
+               for (k = 0; k < a; k++)
+                  for (unsigned int i = 0; i < fill[f].len; i++)
+                     buf[len++] = fill[f].s[i];
+               int bad = (seq[q].bad ? -1 : 0);
+               if (utf8_scalar (buf, len) != bad)
+               {
+                  fprintf (stderr, "scalar: seq %u fill %u n %u after %u\n", q, f, n, a);
+                  return "UTF-8 scalar wrong";
+               }
+#if defined(__x86_64__) || defined(__i386__)
+               if (__builtin_cpu_supports ("avx2") && !utf8_avx2 (buf, len) != !bad)
+               {
+                  fprintf (stderr, "avx2: seq %u fill %u n %u after %u\n", q, f, n, a);
+                  return "UTF-8 avx2 mismatch";
+               }
+               if (__builtin_cpu_supports ("sse4.1") && !utf8_sse4 (buf, len) != !bad)
+               {
+                  fprintf (stderr, "sse4: seq %u fill %u n %u after %u\n", q, f, n, a);
+                  return "UTF-8 sse4 mismatch";
+               }
+#endif
+               if (!websocket_utf8 (buf, len) != !bad)
+                  return "UTF-8 check mismatch";
+               for (k = 0; k <= len; k++)
+               {                // Two parts, any unfinished sequence held over
+                  websocket_t w = { 0 };
+                  int r = websocket_rx_utf8 (&w, buf, k, 0);
+                  if (!r)
+                     r = websocket_rx_utf8 (&w, buf + k, len - k, 1);
+                  if (!r != !bad)
+                  {
+                     fprintf (stderr, "split %zu: seq %u fill %u n %u after %u\n", k, q, f, n, a);
+                     return "UTF-8 split mismatch";
+                  }
+               }
+            }
+   return NULL;
+}
+
+static const char *
+websocket_selftest_router (void)
+{                               // Check router precedence, with and without a catch all path, returns error
+   static const struct
+   {
+      const char *host,
+       *path,
+       *origin;
+   } bound[] = {                // Newest first, as on the bind
+      {NULL, "/a/b", "o1"},     // 0
+      {NULL, "/a/b", NULL},     // 1
+      {NULL, "/a/*", NULL},     // 2
+      {NULL, "/a/**", NULL},    // 3
+      {NULL, NULL, NULL},       // 4 catch all
+      {"h1", "/a/**", NULL},    // 5
+      {"h1", NULL, "o2"},       // 6
+      {NULL, "/d", "o3"},       // 7
+      {NULL, "/d", "o3"},       // 8 older duplicate
+      {NULL, "/d", "o4"},       // 9
+      {NULL, "/d", "o5"},       // 10
+      {NULL, "/d", "o6"},       // 11
+      {NULL, "/d", "o3"},       // 12 older duplicate, after origins grown
+      {NULL, "/*/c", NULL},     // 13
+      {NULL, "/a/c", NULL},     // 14
+      {"h2", NULL, NULL},       // 15
+      {NULL, "/e/**", NULL},    // 16
+      {NULL, "/a/b", NULL},     // 17 older duplicate
+   };
+   static const struct
+   {
+      const char *host,
+       *origin,
+       *url;
+      int want,                 // Index in bound, -1 for none
+        without;                // Same, without the catch all
+   } req[] = {
+      {NULL, NULL, "/a/b", 1, 1},       // Exact
+      {NULL, "o1", "/a/b", 0, 0},       // Origin
+      {NULL, "o9", "/a/b", 1, 1},       // Other origin
+      {NULL, NULL, "/a/c", 14, 14},     // Exact before *
+      {NULL, NULL, "/b/c", 13, 13},
+      {NULL, NULL, "/a/x", 2, 2},       // * before **
+      {NULL, NULL, "/a/x/y", 3, 3},
+      {NULL, NULL, "/a", 3, 3}, // ** matches where it is
+      {NULL, NULL, "/e", 16, 16},
+      {NULL, NULL, "/e/f/g", 16, 16},
+      {NULL, NULL, "/z", 4, -1},        // NULL path last
+      {NULL, NULL, "/", 4, -1},
+      {"h1", NULL, "/a/b", 5, 5},       // Host first
+      {"h1", "o1", "/a/b", 5, 5},
+      {"h1", "o2", "/a/b", 5, 5},       // Origin last
+      {"h1", "o2", "/x", 6, 6},
+      {"h1", NULL, "/x", 4, -1},
+      {"h2", "o1", "/a/b", 15, 15},
+      {"h3", NULL, "/a/b", 1, 1},       // Other host
+      {NULL, "o3", "/d", 7, 7}, // Newest duplicate
+      {NULL, "o4", "/d", 9, 9},
+      {NULL, "o5", "/d", 10, 10},
+      {NULL, "o6", "/d", 11, 11},
+      {NULL, NULL, "/d", 4, -1},
+   };
+   websocket_path_t p[sizeof (bound) / sizeof (*bound)];
+   websocket_bind_t b;
+   memset (p, 0, sizeof (p));
+   memset (&b, 0, sizeof (b));
+   unsigned int i,
+     pass;
+   for (i = 0; i < sizeof (bound) / sizeof (*bound); i++)
+   {
+      p[i].host = bound[i].host;
+      p[i].path = bound[i].path;
+      p[i].origin = bound[i].origin;
+      p[i].next = (i + 1 < sizeof (bound) / sizeof (*bound) ? &p[i + 1] : NULL);
+   }
+   b.paths = p;
+   const char *e = NULL;
+   for (pass = 0; pass < 2 && !e; pass++)
+   {
+      if (pass)
+         p[3].next = &p[5];     // Unbind the catch all
+      websocket_router_t *rt = router_make (&b);
+      if (!rt)
+         return "Malloc fail";
+      for (i = 0; i < sizeof (req) / sizeof (*req) && !e; i++)
+      {
+         const char *host = req[i].host,
+            *origin = req[i].origin,
+            *url = req[i].url;
+         websocket_path_t *f = router_path (rt, (const unsigned char *) host, host ? strlen (host) : 0,
+                                            (const unsigned char *) origin, origin ? strlen (origin) : 0,
+                                            (const unsigned char *) url, strlen (url));
+         int got = (f ? (int) (f - p) : -1),
+            want = (pass ? req[i].without : req[i].want);
+         if (got != want)
+         {
+            fprintf (stderr, "Router pass %u host %s origin %s url %s: %d not %d\n", pass, host ? : "-", origin ? : "-", url,
+                     got, want);
+            e = "Router precedence wrong";
+         }
+      }
+      router_free (rt);
+   }
+   return e;
+}
+
+#ifdef	USEAJL
+static const char *
+websocket_selftest_json_one (websocket_rxjson_t * p, const char *text, size_t len)
+{                               // Parse one message in whole, byte at a time, every two parts, and random parts, returns error
+   j_t ref = j_create ();
+   const char *re = j_read_mem (ref, text, len);
+   char *rb = NULL;
+   size_t rl = 0;
+   if (!re)
+      j_err (j_write_mem (ref, &rb, &rl));
+   j_delete (&ref);
+   const char *fail = NULL;
+   unsigned int mode,
+     modes = len + 10;
+   for (mode = 0; mode < modes && !fail; mode++)
+   {                            // 0 whole, 1 a byte at a time, 2 to len two parts, then random parts
+      websocket_rxjson_start (p);
+      const char *e = NULL;
+      size_t n = 0;
+      while (!e && n < len)
+      {
+         size_t l = len - n;
+         if (mode == 1)
+            l = 1;
+         else if (mode >= 2 && mode <= len && !n)
+            l = mode - 1;
+         else if (mode > len)
+            l = 1 + random () % (l < 8 ? l : 8);
+         e = websocket_rxjson_feed (p, (const unsigned char *) text + n, l);
+         n += l;
+      }
+      if (!e)
+         e = websocket_rxjson_end (p);
+      if (!e != !re)
+      {
+         fprintf (stderr, "JSON mode %u [%.*s] %s / %s\n", mode, (int) len, text, e ? : "OK", re ? : "OK");
+         fail = "JSON parse mismatch";
+      } else if (!e)
+      {
+         char *b = NULL;
+         size_t l = 0;
+         j_err (j_write_mem (p->json, &b, &l));
+         if (l != rl || memcmp (b, rb, l))
+         {
+            fprintf (stderr, "JSON mode %u [%.*s] [%.*s] / [%.*s]\n", mode, (int) len, text, (int) l, b, (int) rl, rb);
+            fail = "JSON tree mismatch";
+         }
+         free (b);
+      }
+      j_delete (&p->json);
+   }
+   free (rb);
+   return fail;
+}
+
+static const char *
+websocket_selftest_json (void)
+{                               // Check the JSON parse in parts against j_read_mem on the whole message, returns error
+   static const char *good[] = {
+      "{}",
+      " [ ] ",
+      "[[[]],{},[{}]]",
+      "{\"a\":1,\"b\":[true,false,null],\"c\":{\"d\":\"e\"}}",
+      "[0,-0,1,-2.5e+10,1E3,0.125,6.02e-23,123456789012345678901234567890]",
+      " { \"a\" : [ 1 , 2 ] ,\r\n\t\"b\" : { } } ",
+      "{\"s\":\"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\",\"e\":\"\"}",
+      "[\"\\u0041\\u00e9\\u20AC\\ud83d\\ude00\\uD834\\uDD1E\\u001Fx\"]",
+      "{\"caf\\u00e9\":\"\xC3\xA9 \xE2\x98\x83 \xF0\x9F\x98\x80\"}",
+      "\"top \\u00e9\"",
+      "123",
+      " -1.5e3 ",
+      "true",
+      "null",
+   };
+   static const char *bad[] = {
+      "",
+      " ",
+      "{",
+      "{\"a\":1",
+      "{\"a\" 1}",
+      "{a:1}",
+      "{\"a\":1}}",
+      "{\"a\":1}x",
+      "[1 2]",
+      "[1,2",
+      "{\"a\":tru}",
+      "[truex]",
+      "[-]",
+      "[1.]",
+      "[1e]",
+      "[\"\\x\"]",
+      "[\"\\u12G4\"]",
+      "[\"abc",
+      "\"abc",
+   };
+   websocket_rxjson_t p = { 0 };
+   const char *e = NULL;
+   if (!(p.tok = malloc (p.tokmax = 256)) || !(p.name = malloc (p.namemax = 256)))
+      e = "Malloc fail";
+   unsigned int i;
+   for (i = 0; !e && i < sizeof (good) / sizeof (*good); i++)
+      e = websocket_selftest_json_one (&p, good[i], strlen (good[i]));
+   for (i = 0; !e && i < sizeof (bad) / sizeof (*bad); i++)
+      e = websocket_selftest_json_one (&p, bad[i], strlen (bad[i]));
+   if (!e)
+   {                            // Name and string longer than the initial buffers, deeper than the initial stack
+      char big[2000];
+      size_t l = 0;
+      for (i = 0; i < 20; i++)
+         l += sprintf (big + l, "{\"%u\":", i);
+      l += sprintf (big + l, "{\"");
+      for (i = 0; i < 300; i++)
+         big[l++] = 'a' + i % 26;
+      l += sprintf (big + l, "\":\"");
+      for (i = 0; i < 100; i++)
+         l += sprintf (big + l, "x\\u%04X", 0x100 + i * 97);
+      l += sprintf (big + l, "\"}");
+      for (i = 0; i < 20; i++)
+         big[l++] = '}';
+      e = websocket_selftest_json_one (&p, big, l);
+   }
+   free (p.stack);
+   free (p.tok);
+   free (p.name);
+   return e;
+}
+#endif
+
+static const char *
+websocket_selftest (void)
+{                               // Internal checks, returns error
+   const char *e;
+   if ((e = websocket_selftest_unmask ()) || (e = websocket_selftest_utf8 ()) || (e = websocket_selftest_router ()))
+      return e;
+#ifdef	USEAJL
+   if ((e = websocket_selftest_json ()))
+      return e;
+#endif
+   return NULL;
+}
+
 int
 main (int argc, const char *argv[])
 {
+   int selftest = 0;
    const char *origin = NULL;
    const char *host = NULL;
    const char *port = NULL;
@@ -1620,6 +6318,7 @@ main (int argc, const char *argv[])
          {"host", 'H', POPT_ARG_STRING, &host, 0, "Host", "hostname"},
          {"port", 'P', POPT_ARG_STRING, &port, 0, "Port", "name/number"},
          {"path", 'p', POPT_ARG_STRING, &path, 0, "Path", "URL path"},
+         {"self-test", 0, POPT_ARG_NONE, &selftest, 0, "Run internal checks and exit", NULL},
          POPT_AUTOHELP {}
       };
 
@@ -1636,6 +6335,14 @@ main (int argc, const char *argv[])
          return -1;
       }
    }
+   if (selftest)
+   {
+      const char *e = websocket_selftest ();
+      if (e)
+         errx (1, "Self test failed: %s", e);
+      fprintf (stderr, "Self test OK\n");
+      return 0;
+   }
    const char *e = NULL;
 #ifdef	USEAXL
    char *calledxml (websocket_t * w, xml_t head, xml_t data)
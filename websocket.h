@@ -36,6 +36,8 @@
 #include <ajl.h>
 #endif
 
+#include <sys/types.h>
+
 typedef struct websocket_s websocket_t; // Handle for connected web sockets
 
 // Callback function (raw functions pass len+data, otherwise object is parsed from JSON)
@@ -47,6 +49,18 @@ typedef char *websocket_callback_xmlraw_t(websocket_t *, xml_t head, size_t data
 typedef char *websocket_callback_json_t(websocket_t *, j_t head, j_t data);     // return NULL if OK, else connection is closed/rejected
 typedef char *websocket_callback_jsonraw_t(websocket_t *, j_t head, size_t datalen, const unsigned char *data); // return NULL if OK, else connection is closed/rejected
 #endif
+typedef void websocket_callback_full_t(websocket_t *, size_t bytes, int msgs);   // Tx queue over limit (WEBSOCKET_FULL_NOTIFY)
+// Buffer for raw data, like realloc, buf is NULL for a new message else what was returned for earlier fragments (keep the
+// content), size includes a byte for the NULL added, size 0 means free buf (message discarded), return NULL if cannot
+typedef unsigned char *websocket_rxalloc_t(websocket_t *, unsigned char *buf, size_t size);
+// Streamed receive, called with each part of a message as it arrives, from the thread reading the socket even if using
+// workers, data is only valid during the call, flags are WEBSOCKET_RX_..., return NULL if OK, else connection is closed
+typedef char *websocket_rxstream_t(websocket_t *, int flags, size_t len, const unsigned char *data);
+enum {
+   WEBSOCKET_RX_START = 1,      // First part of a message
+   WEBSOCKET_RX_END = 2,        // Last part of a message (can be len 0)
+   WEBSOCKET_RX_BINARY = 4,     // Binary message
+};
 // The callback function is used in several ways.
 // IMPORTANT: Where head/data are defined they are assumed to be consumed / freed by the callback
 // Case                 websocket_t     head    data
@@ -70,8 +84,35 @@ typedef char *websocket_callback_jsonraw_t(websocket_t *, j_t head, size_t datal
 // Binding is done by hostport, but this bind is then checked for origin, host, and path
 // However hostport can be of the form hostname#port, which will try and bind to the hostname only (e.g. localhost)
 // host, origin and path can be NULL to match any
+// path can have * segments to match any one segment, and end /** to match that and anything under it
+// The most specific bind is used, host first, then path (exact segments before *, before **, before NULL), then origin
 // port can be NULL for 80/443
 // keyfile means wss
+// reactors means use an event engine with that many epoll threads (shared by all binds using it, created on first use)
+//   rather than two threads per connection, applies to the port so only on first bind of a port
+// listeners means open that many SO_REUSEPORT listening sockets, each with its own accept thread (or spread over reactors)
+// backlog is the listen backlog (default 10)
+// uring means the event engine (reactors, default 1) uses io_uring for accept, receive and send, needs building with USEURING
+//   and -luring, falls back to epoll if the kernel cannot do it, SSL sockets always use epoll
+// workers means data callbacks run on a pool of that many threads (shared by all binds using it, created on first use)
+//   rather than the thread reading the socket, in order for each connection, applies to the port so only on first bind
+//   and the close callback of a websocket then runs on a worker after its data callbacks, but connect and HTTP callbacks
+//   always run on the thread reading the socket (a reactor thread for the event engine) as their response answers the
+//   request, so should not block
+// workqueue is how many messages can wait for callbacks on one connection before it stops reading (default 100)
+// txbudget is the most bytes of queued messages to gather in to one write (default 65536)
+// zerocopy means payloads of at least that many bytes are sent with MSG_ZEROCOPY (not SSL or io_uring), applies to the port
+// txmaxbytes and txmaxmsgs limit the messages queued to send on each connection (default no limit), and txpolicy is what
+//   happens when over the limit (see WEBSOCKET_FULL_...), txfull is called if WEBSOCKET_FULL_NOTIFY
+// rxmax is the largest message accepted (default no limit), a bigger one is refused before allocating, closing with 1009
+// rxidle means free a connection's message buffer once idle that many seconds (default keep it for the next message)
+// rxalloc provides the buffer each message for a raw callback is unmasked in to (default malloc), the callback then owns it
+// rxstream means messages are passed to it in parts as they arrive rather than to the data callback (rxmax still applies)
+// deflate is a compression level (1-9) to agree permessage-deflate when the client offers it (default not), deflatebits
+//   the most window bits (9-15, default 15), deflatemem the zlib memory level (1-9, default 8), and deflatemin the
+//   smallest payload compressed (default 64), needs -lz
+// deflatetakeover means keep the compression context between messages, so smaller but compressed for each connection,
+//   otherwise a message sent to many connections is compressed once and shared
 // Return is NULL if OK, else error string
 typedef struct {
    const char *port;
@@ -88,10 +129,37 @@ typedef struct {
    websocket_callback_json_t *json;
    websocket_callback_jsonraw_t *jsonraw;
 #endif
+   int reactors;
+   int listeners;
+   int backlog;
+   int uring;
+   int workers;
+   int workqueue;
+   int txbudget;
+   size_t txmaxbytes;
+   int txmaxmsgs;
+   int txpolicy;
+   websocket_callback_full_t *txfull;
+   int zerocopy;
+   size_t rxmax;
+   int rxidle;
+   websocket_rxalloc_t *rxalloc;
+   websocket_rxstream_t *rxstream;
+   int deflate;
+   int deflatebits;
+   int deflatemem;
+   int deflatetakeover;
+   size_t deflatemin;
 } websocket_bindopts_t;
 #define	websocket_bind(...) websocket_bind_opts((websocket_bindopts_t){__VA_ARGS__})
 const char *websocket_bind_opts(websocket_bindopts_t);
 
+// Streamed send, called from the tx thread to fill buf with up to len bytes of the message each time a fragment can be sent
+// Return is the bytes, 0 at the end, or -1 to give up (which closes the connection), it is called with NULL buf when done with
+typedef ssize_t websocket_stream_t(void *arg, unsigned char *buf, size_t len);
+// Release of app owned data, called (from any thread) when the last connection has finished with it
+typedef void websocket_release_t(void *arg, const unsigned char *data);
+
 typedef struct {
    int num;
    websocket_t **ws;
@@ -103,14 +171,52 @@ typedef struct {
 #endif
    size_t len;
    const unsigned char *data;
+   const char *topic;
+   const char *key;
+   int binary;
+   websocket_stream_t *stream;
+   void *arg;
+   size_t fragment;
+   websocket_release_t *release;
 } websocket_send_t;
 #define websocket_send(...) websocket_send_opts((websocket_send_t){__VA_ARGS__})
+#define websocket_publish(t,...) websocket_send_opts((websocket_send_t){.topic=t,__VA_ARGS__})
 const char *websocket_send_opts(websocket_send_t);
 // Send allows sending raw (if data/len set), or xml or json. If no raw, xml, or JSON, this is sending a close
 // If num=0 and ws is NULL, this is send to all
+// If topic is set, this is send to all subscribed to the topic (num and ws are ignored)
+// If key is set, this replaces any message with the same key still waiting to be sent on a connection (latest value wins)
+// If release is set, data is not malloc'd and is not freed, release is called with arg instead
+// If binary is set, raw data or the stream is sent as binary rather than text
+// If stream is set, the message is made by calling stream with arg as it is sent, in fragments of up to fragment bytes
+//   (default 65536), to one connection only, control frames can be sent between fragments
+
+// Pub/sub, subscriptions are removed when the connection closes
+const char *websocket_subscribe(websocket_t *, const char *topic);
+const char *websocket_unsubscribe(websocket_t *, const char *topic);    // NULL topic for all
 
 unsigned long websocket_ping(websocket_t * w);  // Latest ping data (us)
 
+// Policy when a connection's tx queue is over its limit
+enum {
+   WEBSOCKET_FULL_CLOSE,        // Discard the queue and close with 1008 (default)
+   WEBSOCKET_FULL_DROPNEW,      // Do not queue new messages
+   WEBSOCKET_FULL_DROPOLD,      // Drop the oldest messages not yet started
+   WEBSOCKET_FULL_NOTIFY,       // Call txfull from the tx thread (once until under the limit again)
+};
+// With DROPOLD and NOTIFY new messages are not queued if more than twice the limit, the policy is applied between
+// writes so a write blocked on a stalled socket (threads or io_uring) means new messages are dropped at that point
+void websocket_set_txlimit(websocket_t *, size_t bytes, int msgs, int policy);  // Override the bind limits
+size_t websocket_txdepth(websocket_t *, int *msgs);     // Bytes (and messages) queued
+
+// Object pool statistics, live and high are only counted if built with POOLSTATS
+typedef struct {
+   size_t live;                 // Objects in use
+   size_t high;                 // High water mark of objects in use
+   size_t slabs;                // Slabs allocated
+} websocket_poolstat_t;
+void websocket_pool_stats(websocket_poolstat_t * txb, websocket_poolstat_t * txq, websocket_poolstat_t * ws);
+
 // To help linking in
 void *websocket_data(websocket_t *);
 void websocket_set_data(websocket_t *, void *);